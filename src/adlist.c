@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include "adlist.h"
 #include "zmalloc.h"
+#include "slab.h"
 
 list *listCreate(void) {
     list *list;
@@ -23,7 +24,7 @@ void listEmpty(list *list) {
         next = current->next;
         if (list->free) list->free(current->value);
         list->head = current->next;
-        zfree(current);
+        slabFree(SLAB_LIST_NODE,current);
         current = next;
     }
     list->head = list->tail = NULL;
@@ -38,7 +39,7 @@ void listRelease(list *list) {
 list *listAddNodeHead(list *list, void* value) {
     listNode *node;
 
-    if ((node = zmalloc(sizeof(*node))) == NULL) return NULL;
+    if ((node = slabAlloc(SLAB_LIST_NODE,sizeof(*node))) == NULL) return NULL;
     node->value = value;
     if (list->len == 0) {
         list->head = list->tail = node;
@@ -56,7 +57,7 @@ list *listAddNodeHead(list *list, void* value) {
 list *listAddNodeTail(list *list, void* value) {
     listNode *node;
 
-    if ((node = zmalloc(sizeof(*node))) == NULL) return NULL;
+    if ((node = slabAlloc(SLAB_LIST_NODE,sizeof(*node))) == NULL) return NULL;
     node->value = value;
     if (list->len == 0) {
         list->head = list->tail = node;
@@ -74,7 +75,7 @@ list *listAddNodeTail(list *list, void* value) {
 list *listInsertNode(list *list, listNode *old_value, void *value, int after) {
     listNode *node;
 
-    if ((node = zmalloc(sizeof(*node))) == NULL) return NULL;
+    if ((node = slabAlloc(SLAB_LIST_NODE,sizeof(*node))) == NULL) return NULL;
     node->value = value;
     if (after) {
         node->prev = old_value;
@@ -108,7 +109,7 @@ void listDelNode(list *list, listNode *node) {
     else
         list->tail = node->prev;
     if (list->free) list->free(node->value);
-    zfree(node);
+    slabFree(SLAB_LIST_NODE,node);
     list->len--;
 }
 
@@ -32,6 +32,9 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     eventLoop->maxfd = -1;
     eventLoop->beforesleep = NULL;
     eventLoop->aftersleep = NULL;
+    eventLoop->busypoll = 0;
+    eventLoop->busypoll_hits = 0;
+    eventLoop->busypoll_parks = 0;
     if (aeApiCreate(eventLoop) == -1) goto err;
     for (i = 0; i < setsize; i++)
         eventLoop->events[i].mask = AE_NONE;
@@ -67,9 +70,9 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
     aeFileEvent *fe = &eventLoop->events[fd];
     
     if ((aeApiAddEvent(eventLoop, fd, mask)) == -1) return AE_ERR;
-    fe->mask = mask;
-    if (mask | AE_READABLE) fe->rfileProc = proc;
-    if (mask | AE_WRITABLE) fe->wfileProc = proc;
+    fe->mask |= mask;
+    if (mask & AE_READABLE) fe->rfileProc = proc;
+    if (mask & AE_WRITABLE) fe->wfileProc = proc;
     fe->clientData = clientData;
     if (fd > eventLoop->maxfd) eventLoop->maxfd = fd;
     return AE_OK;
@@ -78,7 +81,7 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
 void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask) {
     if (fd > eventLoop->maxfd) return;
     aeFileEvent *fe = &eventLoop->events[fd];
-    if (mask | AE_NONE) return;
+    if (fe->mask == AE_NONE) return;
 
     aeApiDelEvent(eventLoop, fd, mask);
     fe->mask = fe->mask & (~mask);
@@ -301,9 +304,8 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags) {
                 fe->wfileProc(eventLoop, fd, fe->clientData, mask);
                 fired++;
             }
+            processed++;
         }
-
-        processed++;
     }
     /* Check time events */
     if (flags & AE_TIME_EVENTS)
@@ -332,14 +334,47 @@ int aeWait(int fd, int mask, long long milliseconds) {
     }
 }
 
+static long long aeUstime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* Poll the file events without blocking for up to eventLoop->busypoll
+ * microseconds. Returns 1 if some were processed, so that the caller
+ * can go on without sleeping, 0 if the time is over and it should block.
+ * Time events are only run when file events were found: otherwise the
+ * blocking call that follows takes care of them. */
+static int aeBusyPoll(aeEventLoop *eventLoop) {
+    long long deadline = aeUstime()+eventLoop->busypoll;
+
+    do {
+        if (aeProcessEvents(eventLoop, AE_FILE_EVENTS|AE_DONT_WAIT)) {
+            processTimeEvents(eventLoop);
+            eventLoop->busypoll_hits++;
+            return 1;
+        }
+    } while (!eventLoop->stop && aeUstime() < deadline);
+    eventLoop->busypoll_parks++;
+    return 0;
+}
+
 void aeMain(aeEventLoop *eventLoop) {
     eventLoop->stop = 0;
     while (!eventLoop->stop) {
         if (eventLoop->beforesleep) eventLoop->beforesleep(eventLoop);
+        if (eventLoop->busypoll && aeBusyPoll(eventLoop)) continue;
         aeProcessEvents(eventLoop, AE_ALL_EVENTS | AE_CALL_AFTER_SLEEP);
     }
 }
 
+/* Spin up to 'usec' microseconds on the file events before blocking, 0 to
+ * always block. This trades CPU for the latency of waking up. */
+void aeSetBusyPoll(aeEventLoop *eventLoop, long long usec) {
+    eventLoop->busypoll = usec;
+}
+
 char *aeGetApiName(void) {
     return aeApiName();
 }
@@ -65,6 +65,9 @@ typedef struct aeEventLoop {
     void *apidata;
     aeBeforeSleepProc *beforesleep;
     aeBeforeSleepProc *aftersleep;
+    long long busypoll;     /* Microseconds to poll before blocking, or 0 */
+    long long busypoll_hits;  /* Events found while polling */
+    long long busypoll_parks; /* Polls that ended up blocking */
 } aeEventLoop;
 
 /* Prototypes */
@@ -85,6 +88,7 @@ void aeMain(aeEventLoop *eventLoop);
 char *aeGetApiName(void);
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
 void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep);
+void aeSetBusyPoll(aeEventLoop *eventLoop, long long usec);
 int aeGetSetSize(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
 
@@ -49,12 +49,17 @@ static void aeApiFree(aeEventLoop *eventLoop) {
 static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
     aeApiState *state = eventLoop->apidata;
     struct epoll_event ev;
+    /* If the fd was already monitored for some event, we need a MOD
+     * operation. Otherwise we need an ADD operation. */
+    int op = eventLoop->events[fd].mask == AE_NONE ?
+            EPOLL_CTL_ADD : EPOLL_CTL_MOD;
 
     ev.events = 0;
+    mask |= eventLoop->events[fd].mask; /* Merge old events */
     if (mask & AE_READABLE) ev.events |= EPOLLIN;
     if (mask & AE_WRITABLE) ev.events |= EPOLLOUT;
     ev.data.fd = fd;
-    if (epoll_ctl(state->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    if (epoll_ctl(state->epfd, op, fd, &ev) == -1)
         return -1;
     return 0;
 }
@@ -68,7 +73,7 @@ static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
     if (mask & AE_READABLE) ev.events |= EPOLLIN;
     if (mask & AE_WRITABLE) ev.events |= EPOLLOUT;
     ev.data.fd = fd;
-    if (mask & AE_NONE) {
+    if (mask == AE_NONE) {
         epoll_ctl(state->epfd, EPOLL_CTL_DEL, fd, &ev);
     } else {
         epoll_ctl(state->epfd, EPOLL_CTL_MOD, fd, &ev);
@@ -0,0 +1,158 @@
+#include "server.h"
+#include "sha256.h"
+
+/*-----------------------------------------------------------------------------
+ * Private and presence channels authentication
+ *
+ * Subscribing to a private or presence channel requires an auth signature
+ * in the form "<app key>:<signature>", where the signature is the hex
+ * encoded HMAC-SHA256 of the string to sign keyed by the app secret. The
+ * string to sign is "<socket id>:<channel>", followed by ":<channel data>"
+ * for presence channels.
+ *
+ * The socket id is the id the server gave to the connection, so a signature
+ * is only valid for the connection it was made for. Verified signatures are
+ * remembered in server.auth_cache, per connection and channel, so that a
+ * client going back to a channel it left (or resuming it) doesn't pay an
+ * HMAC again. A client reconnecting has a new socket id and needs new
+ * signatures anyway: its entries are dropped when it is freed. Verification
+ * runs in the thread pool like every command, and does not hold any pubsub
+ * lock, so it never stalls the event loop nor the delivery of messages.
+ *----------------------------------------------------------------------------*/
+
+int pubsubChannelRequiresAuth(sds channel) {
+    return pubsubIsPresenceChannel(channel) ||
+           (sdslen(channel) > PRIVATE_CHANNEL_PREFIX_LEN &&
+            !memcmp(channel,PRIVATE_CHANNEL_PREFIX,PRIVATE_CHANNEL_PREFIX_LEN));
+}
+
+/* Compare two strings in a time that only depends on their length, so that
+ * the signature can't be guessed one byte at a time. */
+static int timeIndependentCompare(const char *a, const char *b, size_t len) {
+    unsigned char diff = 0;
+    size_t j;
+
+    for (j = 0; j < len; j++) diff |= a[j] ^ b[j];
+    return diff == 0;
+}
+
+/* Return 1 if 'given' matches 'password'. There is no match when no
+ * password is configured. */
+int authCheckPassword(const char *password, const char *given) {
+    size_t len;
+
+    if (password == NULL) return 0;
+    len = strlen(password);
+    return strlen(given) == len && timeIndependentCompare(given,password,len);
+}
+
+/* Return 1 if 'auth' was already verified for the same channel data. */
+static int authCacheLookup(sds id, sds channel, sds value) {
+    dict *channels;
+    sds cached = NULL;
+    int found;
+
+    pthread_mutex_lock(&server.auth_lock);
+    channels = dictFetchValue(server.auth_cache,id);
+    if (channels) cached = dictFetchValue(channels,channel);
+    found = cached && sdscmp(cached,value) == 0;
+    pthread_mutex_unlock(&server.auth_lock);
+    return found;
+}
+
+/* Remember a verified auth. When the cache is full a random entry is
+ * evicted, so that both lookups and insertions stay O(1). */
+static void authCacheAdd(sds id, sds channel, sds value) {
+    dictEntry *de;
+    dict *channels;
+
+    if (server.auth_cache_size == 0) return;
+
+    pthread_mutex_lock(&server.auth_lock);
+    if (server.auth_cache_len >= server.auth_cache_size) {
+        de = dictGetRandomKey(server.auth_cache);
+        channels = dictGetVal(de);
+        dictDelete(channels,dictGetKey(dictGetRandomKey(channels)));
+        server.auth_cache_len--;
+        if (dictSize(channels) == 0)
+            dictDelete(server.auth_cache,dictGetKey(de));
+    }
+    if ((channels = dictFetchValue(server.auth_cache,id)) == NULL) {
+        channels = dictCreate(&authClientCacheDictType,NULL);
+        dictAdd(server.auth_cache,sdsdup(id),channels);
+    }
+    if ((de = dictFind(channels,channel)) != NULL) {
+        sdsfree(dictGetVal(de));
+        dictSetVal(channels,de,sdsdup(value));
+    } else {
+        dictAdd(channels,sdsdup(channel),sdsdup(value));
+        server.auth_cache_len++;
+    }
+    pthread_mutex_unlock(&server.auth_lock);
+}
+
+/* Drop the cached auths of a client being freed. */
+void authCacheUnlinkClient(client *c) {
+    dict *channels;
+    sds id;
+
+    id = sdsfromlonglong((long long)c->id);
+    pthread_mutex_lock(&server.auth_lock);
+    if ((channels = dictFetchValue(server.auth_cache,id)) != NULL) {
+        server.auth_cache_len -= dictSize(channels);
+        dictDelete(server.auth_cache,id);
+    }
+    pthread_mutex_unlock(&server.auth_lock);
+    sdsfree(id);
+}
+
+/* Check the auth signature 'auth' given by the client 'c' in order to
+ * subscribe to 'channel'. 'channel_data' is NULL for private channels.
+ * Returns C_OK if the client is allowed to subscribe, C_ERR otherwise. */
+int authVerifyChannel(client *c, sds channel, sds auth, sds channel_data) {
+    static const char hex[] = "0123456789abcdef";
+    unsigned char digest[SHA256_BLOCK_SIZE];
+    char signature[SHA256_BLOCK_SIZE*2];
+    size_t keylen;
+    char *sep;
+    sds id, value, tosign;
+    int j, retval = C_ERR;
+
+    if (server.app_key == NULL || server.app_secret == NULL) return C_ERR;
+
+    id = sdscatfmt(sdsempty(),"%U",(unsigned long long)c->id);
+    value = sdsdup(auth);
+    if (channel_data) value = sdscatfmt(value,"\n%S",channel_data);
+    if (authCacheLookup(id,channel,value)) {
+        sdsfree(id);
+        sdsfree(value);
+        return C_OK;
+    }
+
+    /* The auth is "<app key>:<signature>". */
+    keylen = strlen(server.app_key);
+    sep = strchr(auth,':');
+    if (sep == NULL || (size_t)(sep-auth) != keylen ||
+        memcmp(auth,server.app_key,keylen) ||
+        sdslen(auth)-keylen-1 != sizeof(signature)) goto cleanup;
+
+    tosign = sdscatfmt(sdsdup(id),":%S",channel);
+    if (channel_data) tosign = sdscatfmt(tosign,":%S",channel_data);
+    hmac_sha256((uint8_t*)server.app_secret,strlen(server.app_secret),
+        (uint8_t*)tosign,sdslen(tosign),digest);
+    sdsfree(tosign);
+
+    for (j = 0; j < SHA256_BLOCK_SIZE; j++) {
+        signature[j*2] = hex[digest[j] >> 4];
+        signature[j*2+1] = hex[digest[j] & 0xf];
+    }
+    if (timeIndependentCompare(sep+1,signature,sizeof(signature))) {
+        authCacheAdd(id,channel,value);
+        retval = C_OK;
+    }
+
+cleanup:
+    sdsfree(id);
+    sdsfree(value);
+    return retval;
+}
@@ -0,0 +1,97 @@
+#include "bloom.h"
+#include "zmalloc.h"
+
+#include <string.h>
+
+uint64_t siphash(const uint8_t *in, const size_t inlen, const uint8_t *k);
+
+/* Every node must hash channels the same way, so unlike the dict hash
+ * function the key is fixed. */
+static const uint8_t bloom_hash_seed[16] = {
+    'p','u','s','h','e','r','-','b','l','o','o','m','-','k','e','y'
+};
+
+bloom *bloomCreate(uint64_t bits, int hashes, int counting) {
+    bloom *b = zmalloc(sizeof(*b));
+
+    b->bits = bits;
+    b->hashes = hashes;
+    b->bitmap = zcalloc(bits/8);
+    b->counters = counting ? zcalloc(bits) : NULL;
+    return b;
+}
+
+void bloomRelease(bloom *b) {
+    if (b == NULL) return;
+    zfree(b->bitmap);
+    zfree(b->counters);
+    zfree(b);
+}
+
+/* Hash an element once, the filter bits are all derived from the result
+ * with double hashing, so a single hash can be tested against filters of
+ * different sizes. */
+uint64_t bloomHash(const void *key, size_t len) {
+    return siphash(key,len,bloom_hash_seed);
+}
+
+static uint64_t bloomPosition(bloom *b, uint64_t hash, int j) {
+    uint64_t h1 = hash & 0xffffffff, h2 = (hash >> 32) | 1;
+
+    return (h1 + j*h2) & (b->bits-1);
+}
+
+int bloomGetBit(bloom *b, uint64_t pos) {
+    return (b->bitmap[pos>>3] >> (pos&7)) & 1;
+}
+
+void bloomSetBit(bloom *b, uint64_t pos, int value) {
+    if (value)
+        b->bitmap[pos>>3] |= 1<<(pos&7);
+    else
+        b->bitmap[pos>>3] &= ~(1<<(pos&7));
+}
+
+/* Add an element to a counting filter. The bits that were just set are
+ * stored in 'changed', which must have room for BLOOM_MAX_HASHES entries,
+ * and their number is returned. */
+int bloomAdd(bloom *b, uint64_t hash, uint64_t *changed) {
+    int j, count = 0;
+
+    for (j = 0; j < b->hashes; j++) {
+        uint64_t pos = bloomPosition(b,hash,j);
+
+        /* A saturated counter is never decremented again. */
+        if (b->counters[pos] == UINT8_MAX) continue;
+        if (b->counters[pos]++ == 0) {
+            bloomSetBit(b,pos,1);
+            changed[count++] = pos;
+        }
+    }
+    return count;
+}
+
+/* Remove an element added with bloomAdd(). The bits that were cleared are
+ * stored in 'changed' like bloomAdd() does. */
+int bloomRemove(bloom *b, uint64_t hash, uint64_t *changed) {
+    int j, count = 0;
+
+    for (j = 0; j < b->hashes; j++) {
+        uint64_t pos = bloomPosition(b,hash,j);
+
+        if (b->counters[pos] == UINT8_MAX || b->counters[pos] == 0) continue;
+        if (--b->counters[pos] == 0) {
+            bloomSetBit(b,pos,0);
+            changed[count++] = pos;
+        }
+    }
+    return count;
+}
+
+int bloomMayContain(bloom *b, uint64_t hash) {
+    int j;
+
+    for (j = 0; j < b->hashes; j++)
+        if (!bloomGetBit(b,bloomPosition(b,hash,j))) return 0;
+    return 1;
+}
@@ -0,0 +1,33 @@
+/* Bloom filters, used by the cluster to tell the other nodes which channels
+ * we have subscribers for without sending them the channel names.
+ *
+ * A counting filter keeps a counter for every bit so that channels can be
+ * removed as well as added, a plain filter only keeps the bits. */
+
+#ifndef __BLOOM_H
+#define __BLOOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLOOM_MAX_HASHES 16
+#define BLOOM_MIN_BITS 1024
+#define BLOOM_MAX_BITS (1ULL<<24) /* 16MB of counters, 2MB per node */
+
+typedef struct bloom {
+    uint64_t bits;              /* Number of bits, power of two */
+    int hashes;                 /* Bits set for every element */
+    unsigned char *bitmap;
+    uint8_t *counters;          /* NULL for plain filters */
+} bloom;
+
+bloom *bloomCreate(uint64_t bits, int hashes, int counting);
+void bloomRelease(bloom *b);
+uint64_t bloomHash(const void *key, size_t len);
+int bloomAdd(bloom *b, uint64_t hash, uint64_t *changed);
+int bloomRemove(bloom *b, uint64_t hash, uint64_t *changed);
+int bloomMayContain(bloom *b, uint64_t hash);
+int bloomGetBit(bloom *b, uint64_t pos);
+void bloomSetBit(bloom *b, uint64_t pos, int value);
+
+#endif /* __BLOOM_H */
@@ -0,0 +1,535 @@
+#include "server.h"
+#include "cluster.h"
+
+/* Pusher cluster.
+ *
+ * Every node connects to all the nodes listed in its configuration with a
+ * persistent TCP link on their cluster port (by default the client port
+ * plus CLUSTER_PORT_INCR). A node uses its own link to tell the others
+ * which channels it has local subscribers for, and to forward them the
+ * messages published on those channels, so that a PUBLISH only reaches
+ * the nodes actually interested in it.
+ *
+ * The channels are not sent by name: every node keeps a counting Bloom
+ * filter of its channels and the others get a copy of its bits, sent in
+ * full when the link is established and then as the bits change. A false
+ * positive only costs a message the other node will have no one to give
+ * to, while the metadata sent stays proportional to the subscriptions.
+ *
+ * The bus speaks a line protocol:
+ *
+ *   node <name>                        First message, identifies the sender
+ *   bloom <bits> <hashes>              Size of the sender filter, all clear
+ *   bits <+pos|-pos> ...               Filter bits set or cleared
+ *   pub <channel> <message> [<key>]    Deliver to the local subscribers
+ *
+ * Messages are appended to the link send buffer by the thread pool workers
+ * and written, many at a time, before the event loop goes to sleep. */
+
+static void clusterReadHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+static void clusterWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+
+/* -----------------------------------------------------------------------------
+ * Nodes and links
+ * -------------------------------------------------------------------------- */
+
+static clusterNode *createClusterNode(char *ip, int port) {
+    clusterNode *node = zmalloc(sizeof(*node));
+
+    snprintf(node->ip,sizeof(node->ip),"%s",ip);
+    node->port = port;
+    node->name = sdscatfmt(sdsempty(),"%s:%i",ip,port);
+    node->link = NULL;
+    node->inbound_link = NULL;
+    node->connect_time = 0;
+    node->interests = NULL;
+    return node;
+}
+
+static clusterLink *createClusterLink(int fd, clusterNode *node, int inbound) {
+    clusterLink *link = zmalloc(sizeof(*link));
+
+    link->fd = fd;
+    link->ctime = mstime();
+    link->sndbuf = sdsempty();
+    link->rcvbuf = sdsempty();
+    link->node = node;
+    link->inbound = inbound;
+    return link;
+}
+
+/* Free a cluster link, closing its socket. The caller must hold the
+ * cluster lock. When the inbound link of a node goes away we also forget
+ * about its filter: it will send it again once reconnected. */
+static void freeClusterLink(clusterLink *link) {
+    clusterNode *node = link->node;
+
+    if (node) {
+        if (link->inbound && node->inbound_link == link) {
+            node->inbound_link = NULL;
+            bloomRelease(node->interests);
+            node->interests = NULL;
+        } else if (!link->inbound && node->link == link) {
+            node->link = NULL;
+        }
+        serverLog(LL_VERBOSE,"Cluster %s link with node %s closed",
+            link->inbound ? "inbound" : "outbound", node->name);
+    }
+    aeDeleteFileEvent(server.el,link->fd,AE_READABLE);
+    aeDeleteFileEvent(server.el,link->fd,AE_WRITABLE);
+    close(link->fd);
+    sdsfree(link->sndbuf);
+    sdsfree(link->rcvbuf);
+    zfree(link);
+}
+
+static clusterNode *clusterLookupNode(sds name) {
+    return dictFetchValue(server.cluster->nodes,name);
+}
+
+/* Append a message to the send buffer of 'link'. The caller must hold
+ * the cluster lock. */
+static void clusterSendMessage(clusterLink *link, sds msg) {
+    link->sndbuf = sdscatsds(link->sndbuf,msg);
+    link->sndbuf = sdscatlen(link->sndbuf,"\r\n",2);
+    server.cluster->stat_messages_sent++;
+}
+
+/* Append to 'msgs' "bits" messages with the current value of the 'count'
+ * filter bits at 'pos'. */
+static sds clusterCatBits(sds msgs, uint64_t *pos, size_t count) {
+    size_t j;
+
+    for (j = 0; j < count; j++) {
+        if (j % CLUSTER_BITS_PER_LINE == 0) {
+            if (j) msgs = sdscatlen(msgs,"\r\n",2);
+            msgs = sdscatlen(msgs,"bits",4);
+        }
+        msgs = sdscatfmt(msgs," %s%U",
+            bloomGetBit(server.cluster->interests,pos[j]) ? "+" : "-",
+            (unsigned long long)pos[j]);
+    }
+    if (count) msgs = sdscatlen(msgs,"\r\n",2);
+    return msgs;
+}
+
+/* Send to a freshly connected node our whole filter. The caller must hold
+ * the cluster lock. */
+static void clusterSendInterests(clusterLink *link) {
+    bloom *b = server.cluster->interests;
+    uint64_t pos[CLUSTER_BITS_PER_LINE], j;
+    size_t count = 0;
+
+    link->sndbuf = sdscatfmt(link->sndbuf,"bloom %U %i\r\n",
+        (unsigned long long)b->bits,b->hashes);
+    for (j = 0; j < b->bits/8; j++) {
+        int bit;
+
+        if (b->bitmap[j] == 0) continue;
+        for (bit = 0; bit < 8; bit++) {
+            if (!(b->bitmap[j] & (1<<bit))) continue;
+            pos[count++] = j*8+bit;
+            if (count == CLUSTER_BITS_PER_LINE) {
+                link->sndbuf = clusterCatBits(link->sndbuf,pos,count);
+                count = 0;
+            }
+        }
+    }
+    link->sndbuf = clusterCatBits(link->sndbuf,pos,count);
+}
+
+/* -----------------------------------------------------------------------------
+ * Initialization
+ * -------------------------------------------------------------------------- */
+
+void clusterInit(void) {
+    listIter li;
+    listNode *ln;
+    int j;
+
+    if (!server.cluster_enabled) return;
+
+    server.cluster = zmalloc(sizeof(clusterState));
+    if (server.cluster_port == 0)
+        server.cluster_port = server.port+CLUSTER_PORT_INCR;
+    server.cluster->myname = sdscatfmt(sdsempty(),"%s:%i",
+        server.cluster_announce_ip,server.cluster_port);
+    server.cluster->nodes = dictCreate(&clusterNodesDictType,NULL);
+    server.cluster->interests = bloomCreate(server.cluster_bloom_bits,
+        server.cluster_bloom_hashes,1);
+    server.cluster->changed_bits = NULL;
+    server.cluster->changed_count = 0;
+    server.cluster->changed_size = 0;
+    pthread_mutex_init(&server.cluster->lock,NULL);
+    server.cluster->stat_messages_sent = 0;
+    server.cluster->stat_messages_received = 0;
+
+    listRewind(server.cluster_config_nodes,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        sds addr = listNodeValue(ln);
+        char *p = strrchr(addr,':');
+        clusterNode *node;
+
+        *p = '\0';
+        node = createClusterNode(addr,atoi(p+1));
+        *p = ':';
+        /* Every node may share the same list of nodes: skip ourself. */
+        if (sdscmp(node->name,server.cluster->myname) == 0 ||
+            dictAdd(server.cluster->nodes,node->name,node) != DICT_OK)
+        {
+            sdsfree(node->name);
+            zfree(node);
+        }
+    }
+
+    /* The listening socket may come from the instance we took over. */
+    if (server.cfd_count == 0 &&
+        listenToPort(server.cluster_port,server.cfd,&server.cfd_count)
+        == C_ERR)
+    {
+        serverLog(LL_WARNING, "Opening cluster listening TCP socket %d: %s",
+            server.cluster_port, server.neterr);
+        exit(1);
+    }
+    for (j = 0; j < server.cfd_count; j++) {
+        if (aeCreateFileEvent(server.el, server.cfd[j], AE_READABLE,
+            clusterAcceptHandler, NULL) == AE_ERR)
+                serverPanic("Unrecoverable error creating Pusher Cluster "
+                            "file event.");
+    }
+    serverLog(LL_NOTICE,"Cluster node %s with %lu other nodes",
+        server.cluster->myname, dictSize(server.cluster->nodes));
+}
+
+#define MAX_CLUSTER_ACCEPTS_PER_CALL 1000
+void clusterAcceptHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    int cport, cfd;
+    int max = MAX_CLUSTER_ACCEPTS_PER_CALL;
+    char cip[NET_IP_STR_LEN];
+    clusterLink *link;
+    UNUSED(el);
+    UNUSED(mask);
+    UNUSED(privdata);
+
+    while(max--) {
+        cfd = anetTcpAccept(server.neterr, fd, cip, sizeof(cip), &cport);
+        if (cfd == ANET_ERR) {
+            if (errno != EWOULDBLOCK)
+                serverLog(LL_VERBOSE,
+                    "Error accepting cluster node: %s", server.neterr);
+            return;
+        }
+        anetNonBlock(NULL,cfd);
+        anetEnableTcpNoDelay(NULL,cfd);
+
+        /* The node the link belongs to is only known after the handshake. */
+        serverLog(LL_VERBOSE,"Accepted cluster node %s:%d", cip, cport);
+        link = createClusterLink(cfd,NULL,1);
+        if (aeCreateFileEvent(server.el,cfd,AE_READABLE,
+            clusterReadHandler,link) == AE_ERR)
+        {
+            close(cfd);
+            sdsfree(link->sndbuf);
+            sdsfree(link->rcvbuf);
+            zfree(link);
+        }
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ * Cron and I/O
+ * -------------------------------------------------------------------------- */
+
+/* Called from serverCron(): (re)connect the outbound links. */
+void clusterCron(void) {
+    dictIterator *di;
+    dictEntry *de;
+    mstime_t now = mstime();
+
+    if (!server.cluster_enabled) return;
+
+    di = dictGetIterator(server.cluster->nodes);
+    while ((de = dictNext(di)) != NULL) {
+        clusterNode *node = dictGetVal(de);
+        clusterLink *link;
+        int fd;
+
+        if (node->link ||
+            now - node->connect_time < CLUSTER_RECONNECT_PERIOD) continue;
+        node->connect_time = now;
+
+        fd = anetTcpNonBlockConnect(server.neterr,node->ip,node->port);
+        if (fd == -1) {
+            serverLog(LL_DEBUG,"Unable to connect to cluster node %s: %s",
+                node->name, server.neterr);
+            continue;
+        }
+        anetEnableTcpNoDelay(NULL,fd);
+        link = createClusterLink(fd,node,0);
+
+        /* Nodes never send anything on our outbound links, but reading
+         * from them is how we notice the connection is gone. */
+        if (aeCreateFileEvent(server.el,fd,AE_READABLE,
+            clusterReadHandler,link) == AE_ERR)
+        {
+            pthread_mutex_lock(&server.cluster->lock);
+            freeClusterLink(link);
+            pthread_mutex_unlock(&server.cluster->lock);
+            continue;
+        }
+
+        /* The handshake goes first, before the workers see the link. */
+        pthread_mutex_lock(&server.cluster->lock);
+        link->sndbuf = sdscatfmt(link->sndbuf,"node %S\r\n",
+            server.cluster->myname);
+        node->link = link;
+        clusterSendInterests(link);
+        pthread_mutex_unlock(&server.cluster->lock);
+        serverLog(LL_VERBOSE,"Connecting to cluster node %s", node->name);
+    }
+    dictReleaseIterator(di);
+}
+
+/* Write as much of the send buffer of 'link' as possible. Returns C_ERR
+ * if the link was freed because of an error. The caller must hold the
+ * cluster lock. */
+static int clusterWriteLink(clusterLink *link) {
+    ssize_t nwritten;
+
+    while (sdslen(link->sndbuf)) {
+        nwritten = write(link->fd,link->sndbuf,sdslen(link->sndbuf));
+        if (nwritten <= 0) {
+            if (nwritten == -1 && (errno == EAGAIN || errno == EINPROGRESS))
+                break;
+            freeClusterLink(link);
+            return C_ERR;
+        }
+        sdsrange(link->sndbuf,nwritten,-1);
+    }
+    if (sdslen(link->sndbuf))
+        aeCreateFileEvent(server.el,link->fd,AE_WRITABLE,
+            clusterWriteHandler,link);
+    else
+        aeDeleteFileEvent(server.el,link->fd,AE_WRITABLE);
+    return C_OK;
+}
+
+static void clusterWriteHandler(aeEventLoop *el, int fd, void *privdata,
+                                int mask)
+{
+    UNUSED(el);
+    UNUSED(fd);
+    UNUSED(mask);
+
+    pthread_mutex_lock(&server.cluster->lock);
+    clusterWriteLink(privdata);
+    pthread_mutex_unlock(&server.cluster->lock);
+}
+
+/* Flush the messages queued for the other nodes since the last time we
+ * went to sleep, all of them with a single write per link. The filter bits
+ * changed in the meantime are sent first, once each with their current
+ * value, however many times they flipped. */
+void clusterBeforeSleep(void) {
+    dictIterator *di;
+    dictEntry *de;
+    sds bits = NULL;
+
+    if (!server.cluster_enabled) return;
+
+    pthread_mutex_lock(&server.cluster->lock);
+    if (server.cluster->changed_count) {
+        bits = clusterCatBits(sdsempty(),server.cluster->changed_bits,
+            server.cluster->changed_count);
+        server.cluster->changed_count = 0;
+    }
+    di = dictGetIterator(server.cluster->nodes);
+    while ((de = dictNext(di)) != NULL) {
+        clusterNode *node = dictGetVal(de);
+
+        if (node->link && bits)
+            node->link->sndbuf = sdscatsds(node->link->sndbuf,bits);
+        if (node->link && sdslen(node->link->sndbuf) &&
+            !(aeGetFileEvents(server.el,node->link->fd) & AE_WRITABLE))
+            clusterWriteLink(node->link);
+    }
+    dictReleaseIterator(di);
+    pthread_mutex_unlock(&server.cluster->lock);
+    sdsfree(bits);
+}
+
+/* Process a message received from another node. Returns C_ERR if the link
+ * must be closed. */
+static int clusterProcessMessage(clusterLink *link, int argc, sds *argv) {
+    clusterNode *node = link->node;
+    int retval = C_OK;
+
+    server.cluster->stat_messages_received++;
+    if (!strcmp(argv[0],"node") && argc == 2) {
+        if ((node = clusterLookupNode(argv[1])) == NULL) {
+            serverLog(LL_WARNING,"Unknown cluster node %s connected",argv[1]);
+            return C_ERR;
+        }
+        pthread_mutex_lock(&server.cluster->lock);
+        if (node->inbound_link && node->inbound_link != link)
+            freeClusterLink(node->inbound_link);
+        node->inbound_link = link;
+        link->node = node;
+        bloomRelease(node->interests);
+        node->interests = NULL;
+        pthread_mutex_unlock(&server.cluster->lock);
+        serverLog(LL_VERBOSE,"Cluster node %s connected",node->name);
+    } else if (node == NULL) {
+        /* Everything else requires the handshake. */
+        retval = C_ERR;
+    } else if (!strcmp(argv[0],"bloom") && argc == 3) {
+        unsigned long long bits = strtoull(argv[1],NULL,10);
+        int hashes = atoi(argv[2]);
+
+        if (bits < BLOOM_MIN_BITS || bits > BLOOM_MAX_BITS ||
+            (bits & (bits-1)) || hashes < 1 || hashes > BLOOM_MAX_HASHES)
+        {
+            serverLog(LL_WARNING,"Bad filter from cluster node %s",node->name);
+            return C_ERR;
+        }
+        pthread_mutex_lock(&server.cluster->lock);
+        bloomRelease(node->interests);
+        node->interests = bloomCreate(bits,hashes,0);
+        pthread_mutex_unlock(&server.cluster->lock);
+    } else if (!strcmp(argv[0],"bits") && node->interests) {
+        int j;
+
+        pthread_mutex_lock(&server.cluster->lock);
+        for (j = 1; j < argc; j++) {
+            char *eptr;
+            unsigned long long pos = strtoull(argv[j]+1,&eptr,10);
+
+            if ((argv[j][0] != '+' && argv[j][0] != '-') || *eptr != '\0' ||
+                pos >= node->interests->bits)
+            {
+                retval = C_ERR;
+                break;
+            }
+            bloomSetBit(node->interests,pos,argv[j][0] == '+');
+        }
+        pthread_mutex_unlock(&server.cluster->lock);
+        if (retval == C_ERR)
+            serverLog(LL_WARNING,"Bad filter bits from cluster node %s",
+                node->name);
+    } else if (!strcmp(argv[0],"pub") && (argc == 3 || argc == 4) &&
+               !pubsubHasLineBreak(argv[1]) && !pubsubHasLineBreak(argv[2]) &&
+               (argc == 3 || !pubsubHasLineBreak(argv[3])))
+    {
+        /* Only deliver to our own subscribers: the publishing node already
+         * forwarded the message to every interested node. A lone CR or LF
+         * is refused like in PUBLISH, it would go on to our replicas. A
+         * replica takes its sequence numbers from its master only, so the
+         * message stays out of its history: a number of its own would
+         * break the ones that follow and throw the history away. */
+        pubsubPublishMessage(argv[1],argv[2],argc == 4 ? argv[3] : NULL,
+            replicationIsReplica() ? -1 : 0);
+    } else {
+        serverLog(LL_WARNING,"Bad message from cluster node %s",node->name);
+        retval = C_ERR;
+    }
+    return retval;
+}
+
+static void clusterReadHandler(aeEventLoop *el, int fd, void *privdata,
+                               int mask)
+{
+    char buf[CLUSTER_LINK_READ_LEN];
+    clusterLink *link = privdata;
+    ssize_t nread;
+    char *newline;
+    UNUSED(el);
+    UNUSED(mask);
+
+    nread = read(fd,buf,sizeof(buf));
+    if (nread == -1 && errno == EAGAIN) return;
+    if (nread <= 0 || !link->inbound ||
+        sdslen(link->rcvbuf)+nread > CLUSTER_MAX_LINE_LEN)
+    {
+        goto err;
+    }
+
+    /* Process every complete line, and keep the rest for the next read. */
+    link->rcvbuf = sdscatlen(link->rcvbuf,buf,nread);
+    while ((newline = strstr(link->rcvbuf,"\r\n")) != NULL) {
+        size_t len = newline-link->rcvbuf;
+        sds *argv;
+        int argc, retval = C_OK;
+
+        argv = sdssplitlen(link->rcvbuf,len," ",1,&argc);
+        if (argc) retval = clusterProcessMessage(link,argc,argv);
+        sdsfreesplitres(argv,argc);
+        if (retval == C_ERR) goto err;
+        sdsrange(link->rcvbuf,len+2,-1);
+    }
+    return;
+
+err:
+    pthread_mutex_lock(&server.cluster->lock);
+    freeClusterLink(link);
+    pthread_mutex_unlock(&server.cluster->lock);
+}
+
+/* -----------------------------------------------------------------------------
+ * Pub/Sub propagation
+ * -------------------------------------------------------------------------- */
+
+/* Forward a message published on this node to the nodes having
+ * subscribers for 'channel'. The bus is framed by CRLF, so PUBLISH refuses
+ * the messages holding a CR or a LF, see pubsubHasLineBreak(). */
+void clusterPropagatePublish(sds channel, sds message, sds key) {
+    dictIterator *di;
+    dictEntry *de;
+    sds msg = NULL;
+    uint64_t hash;
+
+    if (!server.cluster_enabled) return;
+
+    hash = bloomHash(channel,sdslen(channel));
+    pthread_mutex_lock(&server.cluster->lock);
+    di = dictGetIterator(server.cluster->nodes);
+    while ((de = dictNext(di)) != NULL) {
+        clusterNode *node = dictGetVal(de);
+
+        if (node->link == NULL || node->interests == NULL ||
+            !bloomMayContain(node->interests,hash)) continue;
+        if (msg == NULL) {
+            msg = sdscatfmt(sdsempty(),"pub %S %S",channel,message);
+            if (key) msg = sdscatfmt(msg," %S",key);
+        }
+        clusterSendMessage(node->link,msg);
+    }
+    dictReleaseIterator(di);
+    pthread_mutex_unlock(&server.cluster->lock);
+    sdsfree(msg);
+}
+
+/* Tell the other nodes we got the first subscriber of 'channel', or that
+ * its last subscriber is gone. Called with the channel shard locked. The
+ * filter bits that changed are only sent in clusterBeforeSleep(). */
+void clusterPropagateInterest(sds channel, int interested) {
+    clusterState *cs = server.cluster;
+    uint64_t changed[BLOOM_MAX_HASHES], hash;
+    int count;
+
+    if (!server.cluster_enabled) return;
+
+    hash = bloomHash(channel,sdslen(channel));
+    pthread_mutex_lock(&cs->lock);
+    if (interested)
+        count = bloomAdd(cs->interests,hash,changed);
+    else
+        count = bloomRemove(cs->interests,hash,changed);
+    if (cs->changed_count+count > cs->changed_size) {
+        cs->changed_size = cs->changed_size ? cs->changed_size*2 : 1024;
+        cs->changed_bits = zrealloc(cs->changed_bits,
+            cs->changed_size*sizeof(uint64_t));
+    }
+    memcpy(cs->changed_bits+cs->changed_count,changed,count*sizeof(uint64_t));
+    cs->changed_count += count;
+    pthread_mutex_unlock(&cs->lock);
+}
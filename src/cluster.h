@@ -0,0 +1,64 @@
+#ifndef __CLUSTER_H
+#define __CLUSTER_H
+
+#include "bloom.h"
+
+/*-----------------------------------------------------------------------------
+ * Pusher cluster data structures, defines, exported API.
+ *----------------------------------------------------------------------------*/
+
+#define CLUSTER_PORT_INCR 10000 /* Cluster port = baseport + PORT_INCR */
+#define CLUSTER_RECONNECT_PERIOD 1000 /* Milliseconds between connections */
+#define CLUSTER_LINK_READ_LEN (16*1024)
+#define CLUSTER_MAX_LINE_LEN (1024*1024) /* Drop links sending longer lines */
+#define CLUSTER_BITS_PER_LINE 1024 /* Bloom filter bits sent per message */
+
+struct clusterNode;
+
+/* clusterLink encapsulates everything needed to talk with a remote node.
+ * Links are one way: every node connects to all the others and uses its
+ * own outbound link to send them messages, while the inbound links
+ * accepted on the cluster port are only read from. */
+typedef struct clusterLink {
+    int fd;                     /* TCP socket file descriptor */
+    mstime_t ctime;             /* Link creation time */
+    sds sndbuf;                 /* Pending messages, flushed before sleep */
+    sds rcvbuf;                 /* Partial line read from the socket */
+    struct clusterNode *node;   /* Node of the link. For inbound links it
+                                   is NULL until the NODE handshake. */
+    int inbound;                /* Accepted on the cluster port. */
+} clusterLink;
+
+typedef struct clusterNode {
+    sds name;                   /* "<ip>:<cluster port>" */
+    char ip[NET_IP_STR_LEN];    /* IP address of the node */
+    int port;                   /* Cluster port of the node */
+    clusterLink *link;          /* Our outbound link to the node */
+    clusterLink *inbound_link;  /* Link the node is talking to us with */
+    mstime_t connect_time;      /* Last connection attempt */
+    bloom *interests;           /* Channels the node has subscribers for,
+                                   NULL until it sent us its filter. */
+} clusterNode;
+
+typedef struct clusterState {
+    sds myname;                 /* Our node name, as the others know it */
+    dict *nodes;                /* Name -> clusterNode */
+    bloom *interests;           /* Counting filter of our channels */
+    uint64_t *changed_bits;     /* Filter bits changed since the last flush */
+    size_t changed_count;
+    size_t changed_size;
+    pthread_mutex_t lock;       /* Protects the filters and the links send
+                                   buffers. */
+    long long stat_messages_sent;
+    long long stat_messages_received;
+} clusterState;
+
+/* ---------------------- API exported outside cluster.c -------------------- */
+void clusterInit(void);
+void clusterAcceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+void clusterCron(void);
+void clusterBeforeSleep(void);
+void clusterPropagatePublish(sds channel, sds message, sds key);
+void clusterPropagateInterest(sds channel, int interested);
+
+#endif /* __CLUSTER_H */
@@ -0,0 +1,352 @@
+#include "server.h"
+#include "bloom.h"
+
+#include <limits.h>
+
+/*-----------------------------------------------------------------------------
+ * Config file parsing
+ *----------------------------------------------------------------------------*/
+
+typedef struct configEnum {
+    const char *name;
+    const int val;
+} configEnum;
+
+static configEnum maxmemory_policy_enum[] = {
+    {"noeviction", MAXMEMORY_NO_EVICTION},
+    {"history", MAXMEMORY_HISTORY},
+    {"history-clients", MAXMEMORY_HISTORY_CLIENTS},
+    {NULL, 0}
+};
+
+/* Get enum value from name. If there is no match INT_MIN is returned. */
+static int configEnumGetValue(configEnum *ce, char *name) {
+    while(ce->name != NULL) {
+        if (!strcasecmp(ce->name,name)) return ce->val;
+        ce++;
+    }
+    return INT_MIN;
+}
+
+/* Get enum name from value. If no match is found NULL is returned. */
+static const char *configEnumGetName(configEnum *ce, int val) {
+    while(ce->name != NULL) {
+        if (ce->val == val) return ce->name;
+        ce++;
+    }
+    return NULL;
+}
+
+const char *maxmemoryPolicyName(int policy) {
+    return configEnumGetName(maxmemory_policy_enum,policy);
+}
+
+static int yesnotoi(char *s) {
+    if (!strcasecmp(s,"yes")) return 1;
+    else if (!strcasecmp(s,"no")) return 0;
+    else return -1;
+}
+
+void loadServerConfigFromString(char *config) {
+    char *err = NULL;
+    int linenum = 0, totlines, i;
+    sds *lines;
+
+    lines = sdssplitlen(config,strlen(config),"\n",1,&totlines);
+
+    for (i = 0; i < totlines; i++) {
+        sds *argv;
+        int argc;
+
+        linenum = i+1;
+        lines[i] = sdstrim(lines[i]," \t\r\n");
+
+        /* Skip comments and blank lines */
+        if (lines[i][0] == '#' || lines[i][0] == '\0') continue;
+
+        /* Split into arguments */
+        argv = sdssplitargs(lines[i],&argc);
+        if (argv == NULL) {
+            err = "Unbalanced quotes in configuration line";
+            goto loaderr;
+        }
+
+        /* Skip this line if the resulting command vector is empty. */
+        if (argc == 0) {
+            sdsfreesplitres(argv,argc);
+            continue;
+        }
+        sdstolower(argv[0]);
+
+        /* Execute config directives */
+        if (!strcasecmp(argv[0],"timeout") && argc == 2) {
+            server.maxidletime = atoi(argv[1]);
+            if (server.maxidletime < 0) {
+                err = "Invalid timeout value"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"tcp-keepalive") && argc == 2) {
+            server.tcpkeepalive = atoi(argv[1]);
+            if (server.tcpkeepalive < 0) {
+                err = "Invalid tcp-keepalive value"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"port") && argc == 2) {
+            server.port = atoi(argv[1]);
+            if (server.port < 0 || server.port > 65535) {
+                err = "Invalid port"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"tcp-backlog") && argc == 2) {
+            server.tcp_backlog = atoi(argv[1]);
+            if (server.tcp_backlog < 0) {
+                err = "Invalid backlog value"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"bind") && argc >= 2) {
+            int j, addresses = argc-1;
+
+            if (addresses > CONFIG_BINDADDR_MAX) {
+                err = "Too many bind addresses specified."; goto loaderr;
+            }
+            for (j = 0; j < addresses; j++)
+                server.bindaddr[j] = zstrdup(argv[j+1]);
+            server.bindaddr_count = addresses;
+        } else if (!strcasecmp(argv[0],"maxclients") && argc == 2) {
+            server.maxclients = atoi(argv[1]);
+            if (server.maxclients < 1) {
+                err = "Invalid max clients limit"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"hz") && argc == 2) {
+            server.config_hz = atoi(argv[1]);
+            if (server.config_hz < CONFIG_MIN_HZ)
+                server.config_hz = CONFIG_MIN_HZ;
+            if (server.config_hz > CONFIG_MAX_HZ)
+                server.config_hz = CONFIG_MAX_HZ;
+        } else if (!strcasecmp(argv[0],"dynamic-hz") && argc == 2) {
+            if ((server.dynamic_hz = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"app-key") && argc == 2) {
+            zfree(server.app_key);
+            server.app_key = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"app-secret") && argc == 2) {
+            zfree(server.app_secret);
+            server.app_secret = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"auth-cache-size") && argc == 2) {
+            server.auth_cache_size = atoi(argv[1]);
+            if (server.auth_cache_size < 0) {
+                err = "Invalid auth cache size"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"flush-delay") && argc == 2) {
+            server.flush_delay = strtoll(argv[1],NULL,10);
+            if (server.flush_delay < 0 ||
+                server.flush_delay > CONFIG_MAX_FLUSH_DELAY)
+            {
+                err = "Invalid flush delay, must be between 0 and 1000 "
+                      "microseconds"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"pubsub-shards") && argc == 2) {
+            long long shards = strtoll(argv[1],NULL,10);
+
+            if (shards < 1 || shards > 65536 || (shards & (shards-1))) {
+                err = "Invalid pubsub shards, must be a power of two "
+                      "between 1 and 65536"; goto loaderr;
+            }
+            server.pubsub_shards_count = shards;
+        } else if (!strcasecmp(argv[0],"cluster-enabled") && argc == 2) {
+            if ((server.cluster_enabled = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"cluster-port") && argc == 2) {
+            server.cluster_port = atoi(argv[1]);
+            if (server.cluster_port < 0 || server.cluster_port > 65535) {
+                err = "Invalid cluster port"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"cluster-announce-ip") && argc == 2) {
+            zfree(server.cluster_announce_ip);
+            server.cluster_announce_ip = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"cluster-node") && argc == 3) {
+            int port = atoi(argv[2]);
+
+            if (port <= 0 || port > 65535) {
+                err = "Invalid cluster node port"; goto loaderr;
+            }
+            listAddNodeTail(server.cluster_config_nodes,
+                sdscatfmt(sdsempty(),"%S:%i",argv[1],port));
+        } else if (!strcasecmp(argv[0],"cluster-bloom-bits") && argc == 2) {
+            unsigned long long bits = strtoull(argv[1],NULL,10);
+
+            if (bits < BLOOM_MIN_BITS || bits > BLOOM_MAX_BITS ||
+                (bits & (bits-1)))
+            {
+                err = "Invalid cluster bloom bits, must be a power of two "
+                      "between 1024 and 16777216, every bit takes a byte of "
+                      "memory"; goto loaderr;
+            }
+            server.cluster_bloom_bits = bits;
+        } else if (!strcasecmp(argv[0],"cluster-bloom-hashes") && argc == 2) {
+            server.cluster_bloom_hashes = atoi(argv[1]);
+            if (server.cluster_bloom_hashes < 1 ||
+                server.cluster_bloom_hashes > BLOOM_MAX_HASHES)
+            {
+                err = "Invalid cluster bloom hashes, must be between 1 "
+                      "and 16"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"handoff-socket") && argc == 2) {
+            zfree(server.handoff_socket);
+            server.handoff_socket = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"history-size") && argc == 2) {
+            server.history_size = strtoll(argv[1],NULL,10);
+            if (server.history_size < 0) {
+                err = "Invalid history size"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"maxmemory") && argc == 2) {
+            int memerr;
+            long long bytes = memtoll(argv[1],&memerr);
+
+            if (memerr || bytes < 0) {
+                err = "Invalid maxmemory"; goto loaderr;
+            }
+            server.maxmemory = bytes;
+        } else if (!strcasecmp(argv[0],"maxmemory-policy") && argc == 2) {
+            server.maxmemory_policy =
+                configEnumGetValue(maxmemory_policy_enum,argv[1]);
+            if (server.maxmemory_policy == INT_MIN) {
+                err = "Invalid maxmemory policy"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"activedefrag") && argc == 2) {
+            if ((server.active_defrag_enabled = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+#ifndef HAVE_DEFRAG
+            if (server.active_defrag_enabled) {
+                err = "Active defragmentation requires a server compiled "
+                      "with jemalloc 5.2 or newer (make MALLOC=jemalloc)";
+                goto loaderr;
+            }
+#endif
+        } else if (!strcasecmp(argv[0],"active-defrag-threshold") &&
+                   argc == 2) {
+            server.active_defrag_threshold = atoi(argv[1]);
+            if (server.active_defrag_threshold < 1) {
+                err = "Invalid active defrag threshold"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"active-defrag-ignore-bytes") &&
+                   argc == 2) {
+            int memerr;
+            long long bytes = memtoll(argv[1],&memerr);
+
+            if (memerr || bytes < 0) {
+                err = "Invalid active defrag ignore bytes"; goto loaderr;
+            }
+            server.active_defrag_ignore_bytes = bytes;
+        } else if (!strcasecmp(argv[0],"active-defrag-cycle") && argc == 2) {
+            server.active_defrag_cycle = atoi(argv[1]);
+            if (server.active_defrag_cycle < 1 ||
+                server.active_defrag_cycle > 99)
+            {
+                err = "Invalid active defrag cycle, must be between 1 "
+                      "and 99"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"lazyfree-threshold") && argc == 2) {
+            server.lazyfree_threshold = atoi(argv[1]);
+            if (server.lazyfree_threshold < 0) {
+                err = "Invalid lazyfree threshold"; goto loaderr;
+            }
+        } else if ((!strcasecmp(argv[0],"server-cpulist") ||
+                    !strcasecmp(argv[0],"worker-cpulist") ||
+                    !strcasecmp(argv[0],"lazyfree-cpulist")) && argc == 2)
+        {
+            char **cpulist = !strcasecmp(argv[0],"server-cpulist") ?
+                             &server.server_cpulist :
+                             !strcasecmp(argv[0],"worker-cpulist") ?
+                             &server.worker_cpulist :
+                             &server.lazyfree_cpulist;
+
+#ifndef USE_SETCPUAFFINITY
+            err = "CPU affinity is not supported on this platform";
+            goto loaderr;
+#endif
+            if (!cpulistIsValid(argv[1])) {
+                err = "Invalid CPU list"; goto loaderr;
+            }
+            zfree(*cpulist);
+            *cpulist = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"busy-poll") && argc == 2) {
+            server.busy_poll = strtoll(argv[1],NULL,10);
+            if (server.busy_poll < 0) {
+                err = "Invalid busy poll time"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"busy-poll-sockets") && argc == 2) {
+            if ((server.busy_poll_sockets = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"worker-busy-poll") && argc == 2) {
+            server.worker_busy_poll = strtoll(argv[1],NULL,10);
+            if (server.worker_busy_poll < 0) {
+                err = "Invalid worker busy poll time"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"inline-commands") && argc == 2) {
+            if ((server.inline_commands = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"replication-password") && argc == 2) {
+            zfree(server.repl_password);
+            server.repl_password = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"replicaof") && argc == 3) {
+            zfree(server.masterhost);
+            server.masterhost = zstrdup(argv[1]);
+            server.masterport = atoi(argv[2]);
+            if (server.masterport <= 0 || server.masterport > 65535) {
+                err = "Invalid master port"; goto loaderr;
+            }
+        } else {
+            err = "Bad directive or wrong number of arguments"; goto loaderr;
+        }
+        sdsfreesplitres(argv,argc);
+    }
+
+    sdsfreesplitres(lines,totlines);
+    return;
+
+loaderr:
+    fprintf(stderr, "\n*** FATAL CONFIG FILE ERROR ***\n");
+    fprintf(stderr, "Reading the configuration file, at line %d\n", linenum);
+    fprintf(stderr, ">>> '%s'\n", lines[i]);
+    fprintf(stderr, "%s\n", err);
+    exit(1);
+}
+
+/* Load the server configuration from the specified filename.
+ * The function appends the additional configuration directives stored
+ * in the 'options' string to the config file before loading.
+ *
+ * Both filename and options can be NULL, in such a case are considered
+ * empty. This way loadServerConfig can be used to just load a file or
+ * just load a string. */
+void loadServerConfig(char *filename, char *options) {
+    sds config = sdsempty();
+    char buf[CONFIG_MAX_LINE+1];
+
+    /* Load the file content */
+    if (filename) {
+        FILE *fp;
+
+        if (filename[0] == '-' && filename[1] == '\0') {
+            fp = stdin;
+        } else {
+            if ((fp = fopen(filename,"r")) == NULL) {
+                serverLog(LL_WARNING,
+                    "Fatal error, can't open config file '%s'", filename);
+                exit(1);
+            }
+        }
+        while(fgets(buf,CONFIG_MAX_LINE+1,fp) != NULL)
+            config = sdscat(config,buf);
+        if (fp != stdin) fclose(fp);
+    }
+    /* Append the additional options */
+    if (options) {
+        config = sdscat(config,"\n");
+        config = sdscat(config,options);
+    }
+    loadServerConfigFromString(config);
+    sdsfree(config);
+}
@@ -10,9 +10,21 @@
 #include <features.h>
 #endif
 
+/* Test for proc filesystem */
+#ifdef __linux__
+#define HAVE_PROC_STAT 1
+#endif
+
+/* Test for setting the CPU affinity of threads */
+#ifdef __linux__
+#define USE_SETCPUAFFINITY 1
+#endif
+
 #define NDEBUG
 
 /* Enable debugging zmalloc */
+#ifndef NO_DEBUG_ZMALLOC
 #define DEBUG_ZMALLOC
+#endif
 
 #endif /* __CONFIG_H */
@@ -0,0 +1,164 @@
+#include "server.h"
+
+/*-----------------------------------------------------------------------------
+ * Active defragmentation
+ *
+ * After a traffic spike the allocator keeps the pages where only a few
+ * long lived objects are left. When the fragmentation is over the
+ * configured threshold, serverCron() walks the channels and the history a
+ * bit at a time, moving every object jemalloc says sits in a sparse page
+ * into a new allocation, so that the sparse pages get empty and can be
+ * given back to the system.
+ *
+ * List nodes and dict entries come from slabs and are not moved.
+ *----------------------------------------------------------------------------*/
+
+#ifdef HAVE_DEFRAG
+
+#define DEFRAG_SCANS_PER_CHECK 16 /* dictScan() calls between time checks */
+
+static unsigned long defrag_shard;  /* Shard being walked */
+static unsigned long defrag_cursor; /* dictScan() cursor in the shard */
+static long long defrag_history;    /* Next history entry, after the shards */
+static long long defrag_start;      /* Start time of the pass */
+
+/* Move an allocation if it is in a sparse page. Returns the new pointer,
+ * or NULL if it was not moved, in which case the old one is still valid. */
+static void *activeDefragAlloc(void *ptr) {
+    void *newptr;
+    size_t size;
+
+    if (!zmalloc_defrag_hint(ptr)) {
+        server.stat_active_defrag_misses++;
+        return NULL;
+    }
+    size = zmalloc_size(ptr);
+    newptr = zmalloc_no_tcache(size);
+    memcpy(newptr,ptr,size);
+    zfree_no_tcache(ptr);
+    server.stat_active_defrag_hits++;
+    return newptr;
+}
+
+static sds activeDefragSds(sds s) {
+    void *ptr, *newptr;
+
+    if (s == NULL) return NULL;
+    ptr = sdsAllocPtr(s);
+    if ((newptr = activeDefragAlloc(ptr)) == NULL) return NULL;
+    return (char*)newptr+(s-(char*)ptr);
+}
+
+static void defragPresenceMember(void *privdata, const dictEntry *constde) {
+    dictEntry *de = (dictEntry*)constde;
+    presenceMember *m = dictGetVal(de), *newm;
+    sds newsds;
+    UNUSED(privdata);
+
+    if ((newsds = activeDefragSds(dictGetKey(de)))) de->key = newsds;
+    if ((newm = activeDefragAlloc(m))) de->v.val = m = newm;
+    if ((newsds = activeDefragSds(m->info))) m->info = newsds;
+}
+
+/* Move a channel and what it owns. The channel name is also the key of
+ * the channels dict. */
+static void defragChannel(void *privdata, const dictEntry *constde) {
+    dictEntry *de = (dictEntry*)constde;
+    pubsubChannel *ch = dictGetVal(de), *newch;
+    list *newlist;
+    dict *newdict;
+    sds newsds;
+    UNUSED(privdata);
+
+    if ((newch = activeDefragAlloc(ch))) de->v.val = ch = newch;
+    if ((newsds = activeDefragSds(ch->name))) de->key = ch->name = newsds;
+    if ((newlist = activeDefragAlloc(ch->clients))) ch->clients = newlist;
+    if ((newsds = activeDefragSds(ch->members_cache)))
+        ch->members_cache = newsds;
+    if (ch->members) {
+        unsigned long cursor = 0;
+
+        if ((newdict = activeDefragAlloc(ch->members))) ch->members = newdict;
+        do {
+            cursor = dictScan(ch->members,cursor,defragPresenceMember,NULL,
+                              NULL);
+        } while (cursor);
+    }
+}
+
+static void defragHistoryEntry(historyEntry *he) {
+    sds newsds;
+
+    if ((newsds = activeDefragSds(he->channel))) he->channel = newsds;
+    if ((newsds = activeDefragSds(he->message))) he->message = newsds;
+    if ((newsds = activeDefragSds(he->key))) he->key = newsds;
+}
+
+/* Called from serverCron(): start a pass when the fragmentation is over
+ * the threshold, and go on with it for at most active-defrag-cycle percent
+ * of the time between two calls. */
+void activeDefragCycle(void) {
+    long long timelimit, iterations = 0;
+
+    if (!server.active_defrag_enabled) return;
+
+    if (!server.active_defrag_running) {
+        size_t allocated, active, resident, frag_bytes;
+        float frag_pct;
+
+        zmalloc_get_allocator_info(&allocated,&active,&resident);
+        if (allocated == 0 || active <= allocated) return;
+        frag_pct = ((float)active/allocated)*100-100;
+        frag_bytes = active-allocated;
+        if (frag_pct < server.active_defrag_threshold ||
+            frag_bytes < server.active_defrag_ignore_bytes) return;
+
+        serverLog(LL_VERBOSE,
+            "Starting active defrag, frag=%.0f%%, frag_bytes=%zu",
+            frag_pct, frag_bytes);
+        server.active_defrag_running = 1;
+        defrag_shard = 0;
+        defrag_cursor = 0;
+        defrag_history = 0;
+        defrag_start = ustime();
+    }
+
+    timelimit = ustime()+server.active_defrag_cycle*10000/server.hz;
+
+    while (defrag_shard < server.pubsub_shards_count) {
+        pubsubShard *shard = server.pubsub_shards+defrag_shard;
+
+        pthread_mutex_lock(&shard->lock);
+        do {
+            defrag_cursor = dictScan(shard->channels,defrag_cursor,
+                                     defragChannel,NULL,NULL);
+        } while (defrag_cursor && ++iterations % DEFRAG_SCANS_PER_CHECK);
+        pthread_mutex_unlock(&shard->lock);
+
+        if (defrag_cursor == 0) defrag_shard++;
+        if (ustime() > timelimit) return;
+    }
+
+    pthread_mutex_lock(&server.history_lock);
+    while (defrag_history < server.history_size) {
+        defragHistoryEntry(server.history+defrag_history++);
+        if (++iterations % DEFRAG_SCANS_PER_CHECK == 0 &&
+            ustime() > timelimit) break;
+    }
+    pthread_mutex_unlock(&server.history_lock);
+    if (defrag_history < server.history_size) return;
+
+    serverLog(LL_VERBOSE,"Active defrag done in %lldms, hits=%lld misses=%lld",
+        (ustime()-defrag_start)/1000,
+        server.stat_active_defrag_hits,
+        server.stat_active_defrag_misses);
+    server.active_defrag_running = 0;
+}
+
+#else /* HAVE_DEFRAG */
+
+void activeDefragCycle(void) {
+    /* Not available without jemalloc. */
+}
+
+#endif
@@ -45,8 +45,10 @@
 
 #include "dict.h"
 #include "zmalloc.h"
+#include "slab.h"
 #include <assert.h>
 
+#ifndef DICT_SWISS
 /* Using dictEnableResize() / dictDisableResize() we make possible to
  * enable/disable resizing of the hash table as needed. This is very 
  * important, as we use copy-on-write and don't want to move too much memory
@@ -65,6 +67,8 @@ static unsigned long _dictNextPower(unsigned long size);
 static long _dictKeyIndex(dict *ht, const void *key, uint64_t hash, dictEntry **existing);
 static int _dictInit(dict *ht, dictType *type, void *privDataPtr);
 
+#endif
+
 /* -------------------------- hash functions -------------------------------- */
 
 static uint8_t dict_hash_function_seed[16];
@@ -91,6 +95,29 @@ uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len) {
     return siphash_nocase(buf,len,dict_hash_function_seed);
 }
 
+/* A faster but non cryptographic hash, see wyhash.c, for the dicts whose
+ * keys can't be chosen by the clients. It is keyed by the same seed. */
+
+uint64_t wyhash(const void *key, size_t len, uint64_t seed);
+
+uint64_t dictGenFastHashFunction(const void *key, int len) {
+    uint64_t seed;
+
+    memcpy(&seed,dict_hash_function_seed,sizeof(seed));
+    return wyhash(key,len,seed);
+}
+
+long long timeInMilliseconds(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000)+(tv.tv_usec/1000);
+}
+
+/* The chained hash tables. dictswiss.c implements the same API with open
+ * addressing when compiled with DICT_SWISS. */
+#ifndef DICT_SWISS
+
 /* ----------------------------- API implementation ------------------------- */
 
 /* Reset a hash table already initialized with ht_init().
@@ -226,13 +253,6 @@ int dictRehash(dict *d, int n) {
     return 1;
 }
 
-long long timeInMilliseconds(void) {
-    struct timeval tv;
-
-    gettimeofday(&tv,NULL);
-    return (((long long)tv.tv_sec)*1000)+(tv.tv_usec/1000);
-}
-
 /* Rehash for an amount of time between ms milliseconds and ms+1 milliseconds */
 int dictRehashMilliseconds(dict *d, int ms) {
     long long start = timeInMilliseconds();
@@ -303,7 +323,7 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
      * system it is more likely that recently added entries are accessed
      * more frequently. */
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-    entry = zmalloc(sizeof(*entry));
+    entry = slabAlloc(SLAB_DICT_ENTRY,sizeof(*entry));
     entry->next = ht->table[index];
     ht->table[index] = entry;
     ht->used++;
@@ -381,7 +401,7 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
                 if (!nofree) {
                     dictFreeKey(d, he);
                     dictFreeVal(d, he);
-                    zfree(he);
+                    slabFree(SLAB_DICT_ENTRY,he);
                 }
                 d->ht[table].used--;
                 return he;
@@ -431,7 +451,7 @@ void dictFreeUnlinkedEntry(dict *d, dictEntry *he) {
     if (he == NULL) return;
     dictFreeKey(d, he);
     dictFreeVal(d, he);
-    zfree(he);
+    slabFree(SLAB_DICT_ENTRY,he);
 }
 
 /* Destroy an entire dictionary */
@@ -449,7 +469,7 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
             nextHe = he->next;
             dictFreeKey(d, he);
             dictFreeVal(d, he);
-            zfree(he);
+            slabFree(SLAB_DICT_ENTRY,he);
             ht->used--;
             he = nextHe;
         }
@@ -1099,6 +1119,8 @@ void dictGetStats(char *buf, size_t bufsize, dict *d) {
     if (orig_bufsize) orig_buf[orig_bufsize-1] = '\0';
 }
 
+#endif /* !DICT_SWISS */
+
 /* ------------------------------- Benchmark ---------------------------------*/
 
 #ifdef DICT_BENCHMARK_MAIN
@@ -1140,6 +1162,42 @@ dictType BenchmarkDictType = {
     printf(msg ": %ld items in %lld ms\n", count, elapsed); \
 } while(0);
 
+/* Hash throughput on names of the lengths channel names usually have,
+ * like "presence-room-42" or "private-user-1234567". */
+void benchmarkHash(long count) {
+    static const int lengths[] = {8, 16, 24, 32, 64};
+    char name[64];
+    uint64_t sum = 0;
+    long long start, elapsed;
+    unsigned int l;
+    long j;
+
+    for (j = 0; j < (long)sizeof(name); j++) name[j] = 'a'+j%26;
+    for (l = 0; l < sizeof(lengths)/sizeof(lengths[0]); l++) {
+        int len = lengths[l];
+
+        start_benchmark();
+        for (j = 0; j < count; j++) {
+            name[0] = j;
+            sum += dictGenHashFunction(name,len);
+        }
+        elapsed = timeInMilliseconds()-start;
+        printf("siphash %2d bytes: %ld hashes in %lld ms\n",
+            len, count, elapsed);
+
+        start_benchmark();
+        for (j = 0; j < count; j++) {
+            name[0] = j;
+            sum += dictGenFastHashFunction(name,len);
+        }
+        elapsed = timeInMilliseconds()-start;
+        printf("wyhash  %2d bytes: %ld hashes in %lld ms\n",
+            len, count, elapsed);
+    }
+    /* Keep the compiler from dropping the loops. */
+    if (sum == 0) printf("\n");
+}
+
 /* dict-benchmark [count] */
 int main(int argc, char **argv) {
     long j;
@@ -1153,6 +1211,8 @@ int main(int argc, char **argv) {
         count = 5000000;
     }
 
+    benchmarkHash(count*10);
+
     start_benchmark();
     for (j = 0; j < count; j++) {
         int retval = dictAdd(dict,sdsfromlonglong(j),(void*)j);
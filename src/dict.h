@@ -52,7 +52,9 @@ typedef struct dictEntry {
         int64_t s64;
         double d;
     } v;
+#ifndef DICT_SWISS
     struct dictEntry *next;
+#endif
 } dictEntry;
 
 typedef struct dictType {
@@ -66,12 +68,26 @@ typedef struct dictType {
 
 /* This is our hash table structure. Every dictionary has two of this as we
  * implement incremental rehashing, for the old to the new table. */
+#ifndef DICT_SWISS
 typedef struct dictht {
     dictEntry **table;
     unsigned long size;
     unsigned long sizemask;
     unsigned long used;
 } dictht;
+#else
+/* With DICT_SWISS the tables use open addressing (see dictswiss.c): the
+ * entries are stored in the table itself, and a control byte per entry
+ * tells if it is empty, deleted, or full and 7 bits of the key hash. */
+typedef struct dictht {
+    uint8_t *ctrl;
+    dictEntry *table;
+    unsigned long size;
+    unsigned long sizemask;
+    unsigned long used;
+    unsigned long deleted;      /* Deleted entries still taking a slot */
+} dictht;
+#endif
 
 typedef struct dict {
     dictType *type;
@@ -98,7 +114,11 @@ typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
 typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 
 /* This is the initial size of every hash table */
+#ifndef DICT_SWISS
 #define DICT_HT_INITIAL_SIZE     4
+#else
+#define DICT_HT_INITIAL_SIZE     16 /* A group of control bytes */
+#endif
 
 /* ------------------------------- Macros ------------------------------------*/
 #define dictFreeVal(d, entry) \
@@ -170,6 +190,7 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count);
 void dictGetStats(char *buf, size_t bufsize, dict *d);
 uint64_t dictGenHashFunction(const void *key, int len);
 uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len);
+uint64_t dictGenFastHashFunction(const void *key, int len);
 void dictEmpty(dict *d, void(callback)(void*));
 void dictEnableResize(void);
 void dictDisableResize(void);
@@ -179,7 +200,10 @@ void dictSetHashFunctionSeed(uint8_t *seed);
 uint8_t *dictGetHashFunctionSeed(void);
 unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata);
 uint64_t dictGetHash(dict *d, const void *key);
+#ifndef DICT_SWISS
 dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t hash);
+#endif
+long long timeInMilliseconds(void);
 
 /* Hash table types */
 extern dictType dictTypeHeapStringCopyKey;
@@ -0,0 +1,706 @@
+/* Open addressing hash tables, implementing the dict.h API when compiled
+ * with DICT_SWISS (make DICT=swiss).
+ *
+ * The layout follows the "Swiss tables" design: the entries are stored in
+ * the table itself instead of a chain of allocated entries, and every
+ * entry has a control byte that is either EMPTY, DELETED, or the low 7 bits
+ * of the hash of the key. Control bytes are checked 16 at a time (a group)
+ * with SSE2, so a lookup compares a single key most of the time and never
+ * follows a pointer before finding it. Groups are probed quadratically,
+ * starting from the group given by the hash.
+ *
+ * Resizing stays incremental like in dict.c: a second table is allocated
+ * and every operation moves one group of the old table to the new one.
+ *
+ * Differences with the chained implementation:
+ *
+ * - dictEntry pointers returned by the API are only valid until the next
+ *   insertion or rehashing step, as entries live in the table. In the same
+ *   way an entry returned by dictUnlink() must be freed before adding
+ *   anything to the dict.
+ * - dictScan() visits every group of the tables in order, and only
+ *   guarantees to return the elements that are not moved by a rehashing
+ *   while the scan is in progress. The bucket callback is never called.
+ */
+
+#ifdef DICT_SWISS
+
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "dict.h"
+#include "zmalloc.h"
+
+#define DICT_GROUP 16           /* Control bytes checked at once */
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe       /* Full entries have the high bit clear */
+
+/* Max load, counting deleted entries: 7/8 like the original design. */
+#define dictOverLoaded(ht,extra) \
+    (((ht)->used+(ht)->deleted+(extra))*8 > (ht)->size*7)
+
+#define dictH1(hash) ((hash) >> 7)
+#define dictH2(hash) ((uint8_t)((hash) & 0x7f))
+#define dictIsFull(ctrl) (((ctrl) & 0x80) == 0)
+
+static int dict_can_resize = 1;
+
+static int _dictExpandIfNeeded(dict *d);
+static unsigned long _dictNextPower(unsigned long size);
+
+/* ------------------------------- Groups ----------------------------------- */
+
+/* Bitmap of the entries of the group at 'ctrl' whose control byte is 'c'. */
+static inline unsigned int groupMatch(const uint8_t *ctrl, uint8_t c) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group,_mm_set1_epi8(c)));
+#else
+    unsigned int mask = 0;
+    int j;
+
+    for (j = 0; j < DICT_GROUP; j++)
+        if (ctrl[j] == c) mask |= 1U << j;
+    return mask;
+#endif
+}
+
+/* Bitmap of the entries that are empty or deleted. */
+static inline unsigned int groupMatchFree(const uint8_t *ctrl) {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+#else
+    unsigned int mask = 0;
+    int j;
+
+    for (j = 0; j < DICT_GROUP; j++)
+        if (!dictIsFull(ctrl[j])) mask |= 1U << j;
+    return mask;
+#endif
+}
+
+#define groupMatchEmpty(ctrl) groupMatch(ctrl,CTRL_EMPTY)
+
+/* ------------------------------- Tables ----------------------------------- */
+
+static void _dictReset(dictht *ht) {
+    ht->ctrl = NULL;
+    ht->table = NULL;
+    ht->size = 0;
+    ht->sizemask = 0;
+    ht->used = 0;
+    ht->deleted = 0;
+}
+
+/* Return the index of 'key' in 'ht', or -1. */
+static long _dictFindIndex(dict *d, dictht *ht, const void *key,
+                           uint64_t hash)
+{
+    unsigned long groups, g, i;
+    uint8_t h2 = dictH2(hash);
+
+    if (ht->used == 0) return -1;
+    groups = ht->size/DICT_GROUP;
+    g = dictH1(hash) & (groups-1);
+    for (i = 0; i < groups; i++) {
+        const uint8_t *ctrl = ht->ctrl+g*DICT_GROUP;
+        unsigned int match = groupMatch(ctrl,h2);
+
+        while (match) {
+            unsigned long idx = g*DICT_GROUP+__builtin_ctz(match);
+
+            if (dictCompareKeys(d,key,ht->table[idx].key)) return idx;
+            match &= match-1;
+        }
+        /* An insertion would have stopped at the first empty entry. */
+        if (groupMatchEmpty(ctrl)) return -1;
+        g = (g+i+1) & (groups-1);
+    }
+    return -1;
+}
+
+/* Take the first free entry along the probe sequence of 'hash'. The table
+ * must not be full. */
+static dictEntry *_dictInsertEntry(dictht *ht, uint64_t hash) {
+    unsigned long groups = ht->size/DICT_GROUP, g, i, idx;
+
+    g = dictH1(hash) & (groups-1);
+    for (i = 0; i < groups; i++) {
+        unsigned int match = groupMatchFree(ht->ctrl+g*DICT_GROUP);
+
+        if (match) {
+            idx = g*DICT_GROUP+__builtin_ctz(match);
+            if (ht->ctrl[idx] == CTRL_DELETED) ht->deleted--;
+            ht->ctrl[idx] = dictH2(hash);
+            ht->used++;
+            return ht->table+idx;
+        }
+        g = (g+i+1) & (groups-1);
+    }
+    assert(0);
+    return NULL;
+}
+
+/* Mark an entry as free. It can be made empty, stopping the lookups early,
+ * only if its group already has an empty entry: no probe sequence going
+ * through the group went further. */
+static void _dictClearEntry(dictht *ht, unsigned long idx) {
+    const uint8_t *group = ht->ctrl+(idx & ~(unsigned long)(DICT_GROUP-1));
+
+    if (groupMatchEmpty(group)) {
+        ht->ctrl[idx] = CTRL_EMPTY;
+    } else {
+        ht->ctrl[idx] = CTRL_DELETED;
+        ht->deleted++;
+    }
+    ht->used--;
+}
+
+/* ----------------------------- API implementation ------------------------- */
+
+static int _dictInit(dict *d, dictType *type, void *privDataPtr) {
+    _dictReset(&d->ht[0]);
+    _dictReset(&d->ht[1]);
+    d->type = type;
+    d->privdata = privDataPtr;
+    d->rehashidx = -1;
+    d->iterators = 0;
+    return DICT_OK;
+}
+
+dict *dictCreate(dictType *type, void *privDataPtr) {
+    dict *d = zmalloc(sizeof(*d));
+
+    _dictInit(d,type,privDataPtr);
+    return d;
+}
+
+/* Resize the table to the minimal size that contains all the elements. */
+int dictResize(dict *d) {
+    if (!dict_can_resize || dictIsRehashing(d)) return DICT_ERR;
+    return dictExpand(d,d->ht[0].used);
+}
+
+/* Expand or create the hash table, so that it can hold 'size' elements.
+ * Expanding to the same size is allowed to get rid of deleted entries. */
+int dictExpand(dict *d, unsigned long size) {
+    dictht n;
+    unsigned long realsize = _dictNextPower(size+size/7+1);
+
+    if (dictIsRehashing(d) || d->ht[0].used > size) return DICT_ERR;
+    if (realsize == d->ht[0].size && d->ht[0].deleted == 0) return DICT_ERR;
+
+    n.size = realsize;
+    n.sizemask = realsize-1;
+    n.ctrl = zmalloc(realsize);
+    memset(n.ctrl,CTRL_EMPTY,realsize);
+    n.table = zmalloc(realsize*sizeof(dictEntry));
+    n.used = 0;
+    n.deleted = 0;
+
+    if (d->ht[0].table == NULL) {
+        d->ht[0] = n;
+        return DICT_OK;
+    }
+    d->ht[1] = n;
+    d->rehashidx = 0;
+    return DICT_OK;
+}
+
+/* Performs N steps of incremental rehashing, every step moving a non empty
+ * group of the old table. The empty groups are skipped without counting
+ * as a step, but no more than N*10 of them are visited per call, so that
+ * a call is bounded even with a mostly empty table. Returns 1 if there are
+ * still keys to move, otherwise 0. */
+int dictRehash(dict *d, int n) {
+    int empty_visits = n*10; /* Max number of empty groups to visit. */
+    unsigned long groups;
+
+    if (!dictIsRehashing(d)) return 0;
+    groups = d->ht[0].size/DICT_GROUP;
+
+    while (n-- && d->ht[0].used != 0) {
+        unsigned long base;
+        unsigned int full;
+
+        /* Note that rehashidx can't overflow as we are sure there are more
+         * elements because ht[0].used != 0 */
+        assert(groups > (unsigned long)d->rehashidx);
+        while ((full = ~groupMatchFree(d->ht[0].ctrl+
+                                       d->rehashidx*DICT_GROUP) & 0xffff) == 0)
+        {
+            d->rehashidx++;
+            if (--empty_visits == 0) return 1;
+        }
+        base = d->rehashidx*DICT_GROUP;
+        while (full) {
+            unsigned long idx = base+__builtin_ctz(full);
+            dictEntry *de = d->ht[0].table+idx;
+
+            *_dictInsertEntry(&d->ht[1],dictHashKey(d,de->key)) = *de;
+            /* Deleted, not empty: lookups in the old table may still have
+             * to go through this group. */
+            d->ht[0].ctrl[idx] = CTRL_DELETED;
+            d->ht[0].used--;
+            full &= full-1;
+        }
+        d->rehashidx++;
+    }
+
+    if (d->ht[0].used == 0) {
+        zfree(d->ht[0].ctrl);
+        zfree(d->ht[0].table);
+        d->ht[0] = d->ht[1];
+        _dictReset(&d->ht[1]);
+        d->rehashidx = -1;
+        return 0;
+    }
+    return 1;
+}
+
+/* Rehash for an amount of time between ms milliseconds and ms+1 milliseconds */
+int dictRehashMilliseconds(dict *d, int ms) {
+    long long start = timeInMilliseconds();
+    int rehashes = 0;
+
+    while(dictRehash(d,100)) {
+        rehashes += 100;
+        if (timeInMilliseconds()-start > ms) break;
+    }
+    return rehashes;
+}
+
+/* A step of rehashing, only if there are no safe iterators. */
+static void _dictRehashStep(dict *d) {
+    if (d->iterators == 0) dictRehash(d,1);
+}
+
+/* Find the table and index of 'key', returns the entry or NULL. */
+static dictEntry *_dictLookup(dict *d, const void *key, uint64_t hash,
+                              int *table, long *index)
+{
+    int t;
+
+    for (t = 0; t <= 1; t++) {
+        long idx = _dictFindIndex(d,&d->ht[t],key,hash);
+
+        if (idx != -1) {
+            if (table) *table = t;
+            if (index) *index = idx;
+            return d->ht[t].table+idx;
+        }
+        if (!dictIsRehashing(d)) break;
+    }
+    return NULL;
+}
+
+int dictAdd(dict *d, void *key, void *val) {
+    dictEntry *entry = dictAddRaw(d,key,NULL);
+
+    if (!entry) return DICT_ERR;
+    dictSetVal(d, entry, val);
+    return DICT_OK;
+}
+
+/* See dictAddRaw() in dict.c. */
+dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing) {
+    dictEntry *entry;
+    uint64_t hash;
+
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+
+    hash = dictHashKey(d,key);
+    if (existing) *existing = NULL;
+    if ((entry = _dictLookup(d,key,hash,NULL,NULL)) != NULL) {
+        if (existing) *existing = entry;
+        return NULL;
+    }
+    if (_dictExpandIfNeeded(d) == DICT_ERR) return NULL;
+
+    entry = _dictInsertEntry(&d->ht[dictIsRehashing(d) ? 1 : 0],hash);
+    dictSetKey(d, entry, key);
+    return entry;
+}
+
+int dictReplace(dict *d, void *key, void *val) {
+    dictEntry *entry, *existing, auxentry;
+
+    entry = dictAddRaw(d,key,&existing);
+    if (entry) {
+        dictSetVal(d, entry, val);
+        return 1;
+    }
+    auxentry = *existing;
+    dictSetVal(d, existing, val);
+    dictFreeVal(d, &auxentry);
+    return 0;
+}
+
+dictEntry *dictAddOrFind(dict *d, void *key) {
+    dictEntry *entry, *existing;
+
+    entry = dictAddRaw(d,key,&existing);
+    return entry ? entry : existing;
+}
+
+/* Remove 'key' from the tables and return its entry, still holding the
+ * key and value, or NULL if not found. */
+static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
+    dictEntry *de;
+    long idx;
+    int table;
+
+    if (dictSize(d) == 0) return NULL;
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+
+    de = _dictLookup(d,key,dictHashKey(d,key),&table,&idx);
+    if (de == NULL) return NULL;
+    _dictClearEntry(&d->ht[table],idx);
+    if (!nofree) {
+        dictFreeKey(d, de);
+        dictFreeVal(d, de);
+    }
+    return de;
+}
+
+int dictDelete(dict *d, const void *key) {
+    return dictGenericDelete(d,key,0) ? DICT_OK : DICT_ERR;
+}
+
+dictEntry *dictUnlink(dict *d, const void *key) {
+    return dictGenericDelete(d,key,1);
+}
+
+void dictFreeUnlinkedEntry(dict *d, dictEntry *he) {
+    if (he == NULL) return;
+    dictFreeKey(d, he);
+    dictFreeVal(d, he);
+}
+
+static int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
+    unsigned long i;
+
+    for (i = 0; i < ht->size && ht->used > 0; i++) {
+        if (callback && (i & 65535) == 0) callback(d->privdata);
+        if (!dictIsFull(ht->ctrl[i])) continue;
+        dictFreeKey(d, ht->table+i);
+        dictFreeVal(d, ht->table+i);
+        ht->used--;
+    }
+    zfree(ht->ctrl);
+    zfree(ht->table);
+    _dictReset(ht);
+    return DICT_OK;
+}
+
+void dictRelease(dict *d) {
+    _dictClear(d,&d->ht[0],NULL);
+    _dictClear(d,&d->ht[1],NULL);
+    zfree(d);
+}
+
+dictEntry *dictFind(dict *d, const void *key) {
+    if (dictSize(d) == 0) return NULL;
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    return _dictLookup(d,key,dictHashKey(d,key),NULL,NULL);
+}
+
+void *dictFetchValue(dict *d, const void *key) {
+    dictEntry *he = dictFind(d,key);
+
+    return he ? dictGetVal(he) : NULL;
+}
+
+/* See dictFingerprint() in dict.c. */
+static long long dictFingerprint(dict *d) {
+    long long integers[6], hash = 0;
+    int j;
+
+    integers[0] = (long) d->ht[0].table;
+    integers[1] = d->ht[0].size;
+    integers[2] = d->ht[0].used;
+    integers[3] = (long) d->ht[1].table;
+    integers[4] = d->ht[1].size;
+    integers[5] = d->ht[1].used;
+
+    for (j = 0; j < 6; j++) {
+        hash += integers[j];
+        hash = (~hash) + (hash << 21);
+        hash = hash ^ (hash >> 24);
+        hash = (hash + (hash << 3)) + (hash << 8);
+        hash = hash ^ (hash >> 14);
+        hash = (hash + (hash << 2)) + (hash << 4);
+        hash = hash ^ (hash >> 28);
+        hash = hash + (hash << 31);
+    }
+    return hash;
+}
+
+dictIterator *dictGetIterator(dict *d) {
+    dictIterator *iter = zmalloc(sizeof(*iter));
+
+    iter->d = d;
+    iter->table = 0;
+    iter->index = -1;
+    iter->safe = 0;
+    iter->entry = NULL;
+    iter->nextEntry = NULL;
+    return iter;
+}
+
+dictIterator *dictGetSafeIterator(dict *d) {
+    dictIterator *i = dictGetIterator(d);
+
+    i->safe = 1;
+    return i;
+}
+
+/* Deleting the returned entry is allowed with a safe iterator, as deleted
+ * entries never move. */
+dictEntry *dictNext(dictIterator *iter) {
+    if (iter->index == -1 && iter->table == 0) {
+        if (iter->safe)
+            iter->d->iterators++;
+        else
+            iter->fingerprint = dictFingerprint(iter->d);
+    }
+    while (1) {
+        dictht *ht = &iter->d->ht[iter->table];
+
+        iter->index++;
+        if (iter->index >= (long) ht->size) {
+            if (dictIsRehashing(iter->d) && iter->table == 0) {
+                iter->table++;
+                iter->index = -1;
+                continue;
+            }
+            /* Keep returning NULL if called again. */
+            iter->index = ht->size;
+            return NULL;
+        }
+        if (dictIsFull(ht->ctrl[iter->index])) {
+            iter->entry = ht->table+iter->index;
+            return iter->entry;
+        }
+    }
+}
+
+void dictReleaseIterator(dictIterator *iter) {
+    if (!(iter->index == -1 && iter->table == 0)) {
+        if (iter->safe)
+            iter->d->iterators--;
+        else
+            assert(iter->fingerprint == dictFingerprint(iter->d));
+    }
+    zfree(iter);
+}
+
+/* Return a random entry from the hash table. */
+dictEntry *dictGetRandomKey(dict *d) {
+    dictht *ht;
+    unsigned long idx;
+
+    if (dictSize(d) == 0) return NULL;
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    do {
+        if (dictIsRehashing(d)) {
+            idx = random() % (d->ht[0].size+d->ht[1].size);
+            ht = &d->ht[0];
+            if (idx >= ht->size) {
+                idx -= ht->size;
+                ht = &d->ht[1];
+            }
+        } else {
+            ht = &d->ht[0];
+            idx = random() & ht->sizemask;
+        }
+    } while (!dictIsFull(ht->ctrl[idx]));
+    return ht->table+idx;
+}
+
+/* Sample up to 'count' entries starting from a random position, see the
+ * same function in dict.c. */
+unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
+    unsigned long j, i, maxsteps, tables;
+    unsigned int stored = 0;
+
+    if (dictSize(d) < count) count = dictSize(d);
+    maxsteps = count*10;
+    for (j = 0; j < count; j++) {
+        if (dictIsRehashing(d)) _dictRehashStep(d);
+        else break;
+    }
+
+    tables = dictIsRehashing(d) ? 2 : 1;
+    i = random();
+    while (stored < count && maxsteps--) {
+        for (j = 0; j < tables; j++) {
+            dictht *ht = &d->ht[j];
+            unsigned long idx;
+
+            if (ht->size == 0) continue;
+            idx = i & ht->sizemask;
+            if (dictIsFull(ht->ctrl[idx])) {
+                *des++ = ht->table+idx;
+                if (++stored == count) return stored;
+            }
+        }
+        i++;
+    }
+    return stored;
+}
+
+/* Visit the group 'v' of both tables. Returns the next cursor, or 0 when
+ * every group was visited. */
+unsigned long dictScan(dict *d,
+                       unsigned long v,
+                       dictScanFunction *fn,
+                       dictScanBucketFunction* bucketfn,
+                       void *privdata)
+{
+    unsigned long groups = 0;
+    int t;
+    DICT_NOTUSED(bucketfn);
+
+    if (dictSize(d) == 0) return 0;
+    for (t = 0; t <= 1; t++) {
+        dictht *ht = &d->ht[t];
+        unsigned long base = v*DICT_GROUP, j;
+
+        if (ht->size/DICT_GROUP > groups) groups = ht->size/DICT_GROUP;
+        if (base >= ht->size) continue;
+        for (j = base; j < base+DICT_GROUP; j++)
+            if (dictIsFull(ht->ctrl[j])) fn(privdata,ht->table+j);
+    }
+    return v+1 < groups ? v+1 : 0;
+}
+
+/* ------------------------- private functions ------------------------------ */
+
+/* Grow the table when it is over the max load. While rehashing the new
+ * table gets the insertions: if it fills up before the old one is empty
+ * the rehashing is completed. With a safe iterator running the entries
+ * can't be moved, and once the last free slot of the new table is used
+ * the insertion fails: callers adding to a dict they iterate must check
+ * dictAdd(). */
+static int _dictExpandIfNeeded(dict *d) {
+    if (dictIsRehashing(d)) {
+        if (!dictOverLoaded(&d->ht[1],1)) return DICT_OK;
+        if (d->iterators) {
+            /* Can't move the entries, use the last free ones. */
+            return d->ht[1].used+d->ht[1].deleted < d->ht[1].size ?
+                   DICT_OK : DICT_ERR;
+        }
+        while (dictRehash(d,100));
+    }
+
+    if (d->ht[0].size == 0) return dictExpand(d,DICT_HT_INITIAL_SIZE);
+    if (dictOverLoaded(&d->ht[0],1)) {
+        /* Twice the elements, or the same size if most of the load is
+         * deleted entries. */
+        if (dictExpand(d,(d->ht[0].used+1)*2) == DICT_ERR) return DICT_ERR;
+        if (d->iterators == 0) _dictRehashStep(d);
+    }
+    return DICT_OK;
+}
+
+static unsigned long _dictNextPower(unsigned long size) {
+    unsigned long i = DICT_HT_INITIAL_SIZE;
+
+    if (size >= LONG_MAX) return LONG_MAX + 1LU;
+    while(1) {
+        if (i >= size)
+            return i;
+        i *= 2;
+    }
+}
+
+void dictEmpty(dict *d, void(callback)(void*)) {
+    _dictClear(d,&d->ht[0],callback);
+    _dictClear(d,&d->ht[1],callback);
+    d->rehashidx = -1;
+    d->iterators = 0;
+}
+
+void dictEnableResize(void) {
+    dict_can_resize = 1;
+}
+
+void dictDisableResize(void) {
+    dict_can_resize = 0;
+}
+
+uint64_t dictGetHash(dict *d, const void *key) {
+    return dictHashKey(d, key);
+}
+
+/* ------------------------------- Debugging ---------------------------------*/
+
+/* Stats of a table, with the number of groups probed after the first one
+ * to reach the elements. */
+static size_t _dictGetStatsHt(char *buf, size_t bufsize, dict *d, int tableid)
+{
+    dictht *ht = &d->ht[tableid];
+    unsigned long groups = ht->size/DICT_GROUP, i;
+    unsigned long totprobes = 0, maxprobes = 0;
+
+    if (ht->used == 0) {
+        return snprintf(buf,bufsize,
+            "No stats available for empty dictionaries\n");
+    }
+
+    for (i = 0; i < ht->size; i++) {
+        unsigned long g, n = 0;
+
+        if (!dictIsFull(ht->ctrl[i])) continue;
+        g = dictH1(dictHashKey(d,ht->table[i].key)) & (groups-1);
+        while (g != i/DICT_GROUP) {
+            n++;
+            g = (g+n) & (groups-1);
+        }
+        totprobes += n;
+        if (n > maxprobes) maxprobes = n;
+    }
+
+    snprintf(buf,bufsize,
+        "Hash table %d stats (%s):\n"
+        " table size: %ld\n"
+        " number of elements: %ld\n"
+        " deleted entries: %ld\n"
+        " load factor: %.02f\n"
+        " avg extra groups probed: %.02f\n"
+        " max extra groups probed: %ld\n",
+        tableid, (tableid == 0) ? "main hash table" : "rehashing target",
+        ht->size, ht->used, ht->deleted,
+        (float)(ht->used+ht->deleted)/ht->size,
+        (float)totprobes/ht->used, maxprobes);
+    if (bufsize) buf[bufsize-1] = '\0';
+    return strlen(buf);
+}
+
+void dictGetStats(char *buf, size_t bufsize, dict *d) {
+    size_t l;
+    char *orig_buf = buf;
+    size_t orig_bufsize = bufsize;
+
+    l = _dictGetStatsHt(buf,bufsize,d,0);
+    buf += l;
+    bufsize -= l;
+    if (dictIsRehashing(d) && bufsize > 0) {
+        _dictGetStatsHt(buf,bufsize,d,1);
+    }
+    /* Make sure there is a NULL term at the end. */
+    if (orig_bufsize) orig_buf[orig_bufsize-1] = '\0';
+}
+
+#endif /* DICT_SWISS */
@@ -0,0 +1,104 @@
+#include "server.h"
+#include "atomicvar.h"
+#include "slab.h"
+
+/*-----------------------------------------------------------------------------
+ * Maxmemory
+ *
+ * When the memory used goes over maxmemory, memory is taken back in this
+ * order, as far as the policy allows:
+ *
+ * 1) The oldest messages of the history are freed, so clients lose the
+ *    ability to RESUME from far back.
+ * 2) The clients that let the most output pile up are disconnected.
+ * 3) Publishes are refused until the memory goes down.
+ *
+ * Every call does a bounded amount of work: the check itself is just a
+ * read of the allocator counters, and what can't be freed in one call is
+ * left to the next one.
+ *----------------------------------------------------------------------------*/
+
+#define EVICT_HISTORY_BATCH 16  /* Messages freed between memory checks */
+#define EVICT_HISTORY_MAX 1024  /* Messages freed per call */
+#define EVICT_CLIENTS_SCAN 256  /* Clients looked at per call */
+#define EVICT_CLIENTS_MAX 4     /* Clients disconnected per call */
+
+/* The memory counted against maxmemory. The free objects of the slab
+ * caches are not given back to the allocator but are reused before any new
+ * allocation, so they are not counted: otherwise, once the clients of a
+ * peak are gone, the history would be evicted for memory nobody uses. */
+size_t evictUsedMemory(void) {
+    size_t used = zmalloc_used_memory(), free = slabFreeMemory();
+
+    return used > free ? used-free : 0;
+}
+
+static int overMaxmemory(void) {
+    return server.maxmemory && evictUsedMemory() > server.maxmemory;
+}
+
+/* Disconnect the client with the most pending output among the next
+ * EVICT_CLIENTS_SCAN ones. Returns 0 if none had any output. */
+static int evictSlowestClient(void) {
+    client *slowest = NULL;
+    unsigned long long slowest_bytes = 0;
+    unsigned long scan = EVICT_CLIENTS_SCAN;
+
+    pthread_mutex_lock(&server.lock);
+    if (scan > clientListLength(&server.clients))
+        scan = clientListLength(&server.clients);
+    while (scan--) {
+        client *c;
+        unsigned long long bytes;
+
+        /* Rotate the list, so the next call looks at the next
+         * clients. */
+        clientListRotate(&server.clients);
+        c = clientListFirst(&server.clients);
+        if (c->flags & (CLIENT_REPLICA|CLIENT_CLOSE_ASAP)) continue;
+        bytes = c->reply_bytes;
+        if (bytes > slowest_bytes) {
+            slowest = c;
+            slowest_bytes = bytes;
+        }
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    if (slowest == NULL) return 0;
+    serverLog(LL_VERBOSE,"Closing client %llu over maxmemory, %llu bytes of "
+        "output pending", (unsigned long long)slowest->id, slowest_bytes);
+    freeClient(slowest);
+    server.stat_evicted_clients++;
+    return 1;
+}
+
+/* Free memory according to the maxmemory policy if we are over the limit.
+ * Clients are only disconnected from the main thread, 'cron' tells we are
+ * called from serverCron(). Returns C_ERR if we are still over the limit,
+ * in which case publishes must be refused. */
+int evictMemoryIfNeeded(int cron) {
+    long long evicted = 0;
+    int clients = 0;
+
+    if (!overMaxmemory()) return C_OK;
+
+    if (server.maxmemory_policy != MAXMEMORY_NO_EVICTION) {
+        while (evicted < EVICT_HISTORY_MAX) {
+            long long count = historyEvictOldest(EVICT_HISTORY_BATCH);
+
+            evicted += count;
+            if (count < EVICT_HISTORY_BATCH || !overMaxmemory()) break;
+        }
+        if (!overMaxmemory()) return C_OK;
+    }
+
+    if (cron && server.maxmemory_policy == MAXMEMORY_HISTORY_CLIENTS) {
+        while (clients < EVICT_CLIENTS_MAX && evictSlowestClient()) {
+            clients++;
+            if (!overMaxmemory()) return C_OK;
+        }
+    }
+
+    if (!cron) atomicIncr(server.stat_oom_rejected_publishes,1);
+    return C_ERR;
+}
@@ -0,0 +1,490 @@
+#include "server.h"
+#include "cluster.h"
+
+#include <sys/socket.h>
+
+/*-----------------------------------------------------------------------------
+ * Handoff
+ *
+ * With handoff-socket configured every instance listens on that Unix socket
+ * for its successor. A new instance started with the same path connects to
+ * it before opening its own listening sockets, and the running instance
+ * hands it off, with SCM_RIGHTS:
+ *
+ * - The listening sockets, so that no connection is refused meanwhile.
+ * - The next client id and the messages history, so that socket ids and
+ *   sequence numbers go on like nothing happened.
+ * - Every client socket, with its subscriptions and pending output.
+ *
+ * Then the old instance exits, and the clients never see a disconnection.
+ * If anything goes wrong before the new instance acknowledged the whole
+ * handoff, the old one goes on serving as before, since it never closed
+ * its own copy of the sockets.
+ *
+ * Every record is a handoffHeader, optionally carrying a file descriptor,
+ * followed by 'len' bytes of payload. The payload of a client is a list of
+ * fields, each one prefixed by its length, since the pending output and the
+ * presence user info are arbitrary bytes.
+ *----------------------------------------------------------------------------*/
+
+#define HANDOFF_LISTENER 1          /* fd: client listening socket */
+#define HANDOFF_CLUSTER_LISTENER 2  /* fd: cluster bus listening socket */
+#define HANDOFF_STATE 3             /* "<next client id> <seq>" + history */
+#define HANDOFF_CLIENT 4            /* fd: a client, payload: its fields */
+#define HANDOFF_END 5
+
+/* Every send and receive of a handoff fails after this long, so that an
+ * instance stuck on the other side can't block us forever. */
+#define HANDOFF_IO_TIMEOUT 5000 /* Milliseconds */
+
+typedef struct handoffHeader {
+    uint32_t type;
+    uint32_t len;
+} handoffHeader;
+
+/* A client received from the old instance, restored once the rest of the
+ * server is initialized. */
+typedef struct handoffClient {
+    int fd;
+    sds state;
+} handoffClient;
+
+static list *handoff_clients = NULL;
+
+/* ---------------------------- Records I/O -------------------------------- */
+
+static int handoffSendRecord(int fd, uint32_t type, int payload_fd,
+                             const char *payload, size_t len)
+{
+    handoffHeader hdr;
+    struct msghdr msg;
+    struct iovec iov;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+
+    hdr.type = type;
+    hdr.len = len;
+    memset(&msg,0,sizeof(msg));
+    iov.iov_base = &hdr;
+    iov.iov_len = sizeof(hdr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (payload_fd != -1) {
+        struct cmsghdr *cmsg;
+
+        memset(cbuf,0,sizeof(cbuf));
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg),&payload_fd,sizeof(int));
+    }
+    if (sendmsg(fd,&msg,0) != sizeof(hdr)) return C_ERR;
+    if (len && anetWrite(fd,(char*)payload,len) != (int)len) return C_ERR;
+    return C_OK;
+}
+
+/* Read a record. '*payload_fd' is set to the descriptor it carries, or -1,
+ * and '*payload' to a new sds with its payload. */
+static int handoffReadRecord(int fd, handoffHeader *hdr, int *payload_fd,
+                             sds *payload)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+
+    memset(&msg,0,sizeof(msg));
+    iov.iov_base = hdr;
+    iov.iov_len = sizeof(*hdr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if (recvmsg(fd,&msg,MSG_WAITALL) != sizeof(*hdr)) return C_ERR;
+
+    *payload_fd = -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        memcpy(payload_fd,CMSG_DATA(cmsg),sizeof(int));
+    }
+
+    *payload = sdsnewlen(NULL,hdr->len);
+    if (hdr->len && anetRead(fd,*payload,hdr->len) != (int)hdr->len) {
+        sdsfree(*payload);
+        if (*payload_fd != -1) close(*payload_fd);
+        return C_ERR;
+    }
+    return C_OK;
+}
+
+/* Append to 's' a field: its length, as an uint32_t, then its bytes. */
+sds handoffCatField(sds s, const char *p, size_t len) {
+    uint32_t flen = len;
+
+    s = sdscatlen(s,&flen,sizeof(flen));
+    return sdscatlen(s,p,len);
+}
+
+/* Read the field at '*p' into '*field', a new sds, and move '*p' past it.
+ * Return C_ERR if the fields end before 'end'. */
+static int handoffReadField(const char **p, const char *end, sds *field) {
+    uint32_t flen;
+
+    if ((size_t)(end-*p) < sizeof(flen)) return C_ERR;
+    memcpy(&flen,*p,sizeof(flen));
+    *p += sizeof(flen);
+    if ((size_t)(end-*p) < flen) return C_ERR;
+    *field = sdsnewlen(*p,flen);
+    *p += flen;
+    return C_OK;
+}
+
+/* ------------------------------ Old instance ----------------------------- */
+
+/* Return the state of 'c' as fields: its id, 1 if it is a replica, its
+ * subscriptions as dumped by pubsubDumpSubscriptions(), and the output not
+ * yet sent to the client. */
+static sds handoffClientState(client *c) {
+    sds output = sdsempty(), state;
+    char buf[32];
+    int len;
+    listIter li;
+    listNode *ln;
+
+    pthread_mutex_lock(&server.lock);
+    if (c->bufpos)
+        output = sdscatlen(output,c->buf+c->sentlen,c->bufpos-c->sentlen);
+    listRewind(c->reply,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        sds o = listNodeValue(ln);
+        size_t skip = (c->bufpos == 0 && ln == listFirst(c->reply)) ?
+                      c->sentlen : 0;
+
+        output = sdscatlen(output,o+skip,sdslen(o)-skip);
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    len = ll2string(buf,sizeof(buf),(long long)c->id);
+    state = handoffCatField(sdsempty(),buf,len);
+    state = handoffCatField(state,(c->flags & CLIENT_REPLICA) ? "1" : "0",1);
+    state = pubsubDumpSubscriptions(c,state);
+    state = handoffCatField(state,output,sdslen(output));
+    sdsfree(output);
+    return state;
+}
+
+static sds handoffServerState(void) {
+    sds state;
+    long long seq;
+
+    pthread_mutex_lock(&server.history_lock);
+    state = sdscatfmt(sdsempty(),"%U %I\r\n",
+        (unsigned long long)server.next_client_id,server.history_seq);
+    for (seq = server.history_seq-server.history_len+1;
+         seq <= server.history_seq; seq++)
+    {
+        sds line = replicationPubLine(server.history+
+                                      (seq % server.history_size));
+
+        state = sdscatfmt(state,"%S\r\n",line);
+        sdsfree(line);
+    }
+    pthread_mutex_unlock(&server.history_lock);
+    return state;
+}
+
+/* Stop, or start again, accepting connections and reading from clients. */
+static void handoffPauseEvents(int pause) {
+    client *c;
+    int j;
+
+    for (j = 0; j < server.ipfd_count; j++) {
+        if (pause)
+            aeDeleteFileEvent(server.el,server.ipfd[j],AE_READABLE);
+        else
+            aeCreateFileEvent(server.el,server.ipfd[j],AE_READABLE,
+                acceptTcpHandler,NULL);
+    }
+    for (j = 0; j < server.cfd_count; j++) {
+        if (pause)
+            aeDeleteFileEvent(server.el,server.cfd[j],AE_READABLE);
+        else
+            aeCreateFileEvent(server.el,server.cfd[j],AE_READABLE,
+                clusterAcceptHandler,NULL);
+    }
+    pthread_mutex_lock(&server.lock);
+    for (c = clientListFirst(&server.clients); c;
+         c = clientListNext(&server.clients,c))
+    {
+        if (pause)
+            aeDeleteFileEvent(server.el,c->fd,AE_READABLE);
+        else if (!c->inflight && !(c->flags & CLIENT_CLOSE_ASAP))
+            aeCreateFileEvent(server.el,c->fd,AE_READABLE,
+                readMessageFromClient,c);
+    }
+    pthread_mutex_unlock(&server.lock);
+}
+
+static int handoffSendAll(int fd) {
+    client *c;
+    sds state;
+    char ack;
+    int j;
+
+    for (j = 0; j < server.ipfd_count; j++)
+        if (handoffSendRecord(fd,HANDOFF_LISTENER,server.ipfd[j],
+                              NULL,0) == C_ERR) return C_ERR;
+    for (j = 0; j < server.cfd_count; j++)
+        if (handoffSendRecord(fd,HANDOFF_CLUSTER_LISTENER,server.cfd[j],
+                              NULL,0) == C_ERR) return C_ERR;
+
+    state = handoffServerState();
+    j = handoffSendRecord(fd,HANDOFF_STATE,-1,state,sdslen(state));
+    sdsfree(state);
+    if (j == C_ERR) return C_ERR;
+
+    for (c = clientListFirst(&server.clients); c;
+         c = clientListNext(&server.clients,c))
+    {
+        if (c->flags & CLIENT_CLOSE_ASAP) continue;
+        state = handoffClientState(c);
+        j = handoffSendRecord(fd,HANDOFF_CLIENT,c->fd,state,sdslen(state));
+        sdsfree(state);
+        if (j == C_ERR) return C_ERR;
+    }
+
+    if (handoffSendRecord(fd,HANDOFF_END,-1,NULL,0) == C_ERR) return C_ERR;
+    /* The new instance acknowledges after it got all the records. */
+    if (read(fd,&ack,1) != 1) return C_ERR;
+    return C_OK;
+}
+
+static void handoffAcceptHandler(aeEventLoop *el, int fd, void *privdata,
+                                 int mask)
+{
+    int cfd;
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    cfd = anetUnixAccept(server.neterr,fd);
+    if (cfd == ANET_ERR) {
+        serverLog(LL_WARNING,"Accepting handoff connection: %s",
+            server.neterr);
+        return;
+    }
+    anetBlock(NULL,cfd);
+    if (anetSendTimeout(server.neterr,cfd,HANDOFF_IO_TIMEOUT) == ANET_ERR ||
+        anetRecvTimeout(server.neterr,cfd,HANDOFF_IO_TIMEOUT) == ANET_ERR)
+    {
+        serverLog(LL_WARNING,"Handoff connection: %s",server.neterr);
+        close(cfd);
+        return;
+    }
+
+    /* Let the commands already read finish, including the ones waiting for
+     * room in the thread pool, so that their replies are handed off too. */
+    serverLog(LL_NOTICE,"Handing off %lu clients to a new instance...",
+        clientListLength(&server.clients));
+    handoffPauseEvents(1);
+    do {
+        postWaitingCommands();
+        thread_pool_wait_idle(server.tpool);
+    } while (clientListLength(&server.clients_waiting_pool));
+
+    if (handoffSendAll(cfd) == C_OK) {
+        serverLog(LL_NOTICE,"Handoff completed, exiting.");
+        exit(0);
+    }
+    serverLog(LL_WARNING,"Handoff failed (%s), serving clients again.",
+        strerror(errno));
+    close(cfd);
+    handoffPauseEvents(0);
+}
+
+/* Listen for a new instance willing to take over. */
+void handoffInit(void) {
+    if (server.handoff_socket == NULL) return;
+
+    unlink(server.handoff_socket); /* don't care if this fails */
+    server.handoff_fd = anetUnixServer(server.neterr,server.handoff_socket,
+        0700,1);
+    if (server.handoff_fd == ANET_ERR) {
+        serverLog(LL_WARNING,"Opening handoff socket %s: %s",
+            server.handoff_socket, server.neterr);
+        exit(1);
+    }
+    anetNonBlock(NULL,server.handoff_fd);
+    if (aeCreateFileEvent(server.el,server.handoff_fd,AE_READABLE,
+        handoffAcceptHandler,NULL) == AE_ERR)
+    {
+        serverPanic("Unrecoverable error creating handoff file event.");
+    }
+}
+
+/* ------------------------------ New instance ----------------------------- */
+
+static int handoffRestoreState(sds state) {
+    unsigned long long next_client_id;
+    long long seq;
+    sds *lines;
+    int count, j, retval = C_ERR;
+
+    lines = sdssplitlen(state,sdslen(state),"\r\n",2,&count);
+    if (count == 0 ||
+        sscanf(lines[0],"%llu %lld",&next_client_id,&seq) != 2) goto cleanup;
+
+    for (j = 1; j < count; j++) {
+        sds *argv;
+        int argc;
+        long long entry_seq;
+
+        if (sdslen(lines[j]) == 0) continue;
+        argv = sdssplitlen(lines[j],sdslen(lines[j])," ",1,&argc);
+        if ((argc == 4 || argc == 5) &&
+            string2ll(argv[1],sdslen(argv[1]),&entry_seq))
+        {
+            historyAdd(argv[2],argv[3],argc == 5 ? argv[4] : NULL,entry_seq);
+        }
+        sdsfreesplitres(argv,argc);
+    }
+    if (server.next_client_id < next_client_id)
+        server.next_client_id = next_client_id;
+    server.history_seq = seq;
+    retval = C_OK;
+
+cleanup:
+    sdsfreesplitres(lines,count);
+    return retval;
+}
+
+/* Take over from the instance listening on the handoff socket, if any.
+ * Called before opening the listening sockets: the ones of the old
+ * instance are used instead. The clients are restored later, by
+ * handoffRestoreClients(). */
+void handoffReceive(void) {
+    handoffHeader hdr;
+    int fd, payload_fd;
+    sds payload;
+    char ack = '+';
+
+    if (server.handoff_socket == NULL) return;
+    if ((fd = anetUnixConnect(server.neterr,server.handoff_socket)) == ANET_ERR)
+        return;
+    anetSendTimeout(NULL,fd,HANDOFF_IO_TIMEOUT);
+    anetRecvTimeout(NULL,fd,HANDOFF_IO_TIMEOUT);
+
+    serverLog(LL_NOTICE,"Taking over from the instance at %s...",
+        server.handoff_socket);
+    handoff_clients = listCreate();
+    while (handoffReadRecord(fd,&hdr,&payload_fd,&payload) == C_OK) {
+        int retval = C_OK;
+
+        if (hdr.type == HANDOFF_LISTENER && payload_fd != -1 &&
+            server.ipfd_count < CONFIG_BINDADDR_MAX)
+        {
+            anetNonBlock(NULL,payload_fd);
+            server.ipfd[server.ipfd_count++] = payload_fd;
+        } else if (hdr.type == HANDOFF_CLUSTER_LISTENER && payload_fd != -1 &&
+                   server.cfd_count < CONFIG_BINDADDR_MAX)
+        {
+            anetNonBlock(NULL,payload_fd);
+            server.cfd[server.cfd_count++] = payload_fd;
+        } else if (hdr.type == HANDOFF_STATE) {
+            retval = handoffRestoreState(payload);
+        } else if (hdr.type == HANDOFF_CLIENT && payload_fd != -1) {
+            handoffClient *hc = zmalloc(sizeof(*hc));
+
+            hc->fd = payload_fd;
+            hc->state = payload;
+            payload = NULL;
+            listAddNodeTail(handoff_clients,hc);
+        } else if (hdr.type == HANDOFF_END) {
+            sdsfree(payload);
+            if (write(fd,&ack,1) != 1) break;
+            close(fd);
+            serverLog(LL_NOTICE,"Got %d listening sockets and %lu clients.",
+                server.ipfd_count+server.cfd_count,
+                listLength(handoff_clients));
+            return;
+        } else {
+            retval = C_ERR;
+        }
+        sdsfree(payload);
+        if (retval == C_ERR) break;
+    }
+
+    /* The old instance goes on serving everyone, we can't do anything
+     * without its sockets. */
+    serverLog(LL_WARNING,"Handoff from %s failed, exiting.",
+        server.handoff_socket);
+    exit(1);
+}
+
+static void handoffRestoreClient(handoffClient *hc) {
+    const char *p = hc->state, *end = hc->state+sdslen(hc->state);
+    sds *fields = NULL;
+    int count = 0, j;
+    long long id, replica, subscriptions;
+    client *c;
+
+    /* The id, the replica flag, the subscriptions count, three fields per
+     * subscription, then the output. */
+    while (p < end) {
+        fields = zrealloc(fields,sizeof(sds)*(count+1));
+        if (handoffReadField(&p,end,fields+count) == C_ERR) break;
+        count++;
+    }
+    if (p != end || count < 4 ||
+        !string2ll(fields[0],sdslen(fields[0]),&id) ||
+        !string2ll(fields[1],sdslen(fields[1]),&replica) ||
+        !string2ll(fields[2],sdslen(fields[2]),&subscriptions) ||
+        subscriptions < 0 || subscriptions > count ||
+        count != 4+subscriptions*3 ||
+        (c = createClient(hc->fd)) == NULL)
+    {
+        close(hc->fd);
+        goto cleanup;
+    }
+    c->id = id;
+
+    for (j = 3; j < count-1; j += 3)
+        pubsubRestoreSubscription(c,fields[j],
+            sdslen(fields[j+1]) ? fields[j+1] : NULL,fields[j+2]);
+
+    if (replica) {
+        pthread_mutex_lock(&server.history_lock);
+        c->flags |= CLIENT_REPLICA;
+        clientListAddTail(&server.replicas,c);
+        pthread_mutex_unlock(&server.history_lock);
+    }
+
+    /* The output is queued back byte for byte, it is already framed. */
+    if (sdslen(fields[count-1]))
+        addReplyProto(c,fields[count-1],sdslen(fields[count-1]));
+
+cleanup:
+    for (j = 0; j < count; j++) sdsfree(fields[j]);
+    zfree(fields);
+}
+
+/* Restore the clients received by handoffReceive(). */
+void handoffRestoreClients(void) {
+    if (handoff_clients == NULL) return;
+
+    while (listLength(handoff_clients)) {
+        listNode *ln = listFirst(handoff_clients);
+        handoffClient *hc = listNodeValue(ln);
+
+        handoffRestoreClient(hc);
+        sdsfree(hc->state);
+        zfree(hc);
+        listDelNode(handoff_clients,ln);
+    }
+    listRelease(handoff_clients);
+    handoff_clients = NULL;
+}
@@ -0,0 +1,65 @@
+#include "server.h"
+#include "atomicvar.h"
+#include "thread_pool.h"
+#include "slab.h"
+
+/*-----------------------------------------------------------------------------
+ * Lazy free
+ *
+ * Freeing a client with thousands of subscriptions or pending replies, or
+ * throwing away a large history, means as many calls to free(), all done
+ * while blocking the event loop or holding a lock. Instead such structures
+ * are unlinked by the caller and released by a thread of their own, when
+ * they have more than lazyfree-threshold elements: below that, posting
+ * them costs more than freeing them.
+ *----------------------------------------------------------------------------*/
+
+void lazyfreeInit(void) {
+    server.lazyfree_pool = thread_pool_create("lazyfree",1,
+        CONFIG_DEFAULT_LAZYFREE_MAX_TASKS,server.lazyfree_cpulist);
+}
+
+static void lazyfreeDone(void *ptr) {
+    UNUSED(ptr);
+    atomicDecr(server.lazyfree_pending_objects,1);
+    atomicIncr(server.stat_lazyfreed_objects,1);
+}
+
+/* Release 'ptr' with 'freefn', in the lazyfree thread if 'effort', the
+ * number of allocations to free, is over the threshold. Also frees in
+ * place if the queue of the thread is full. */
+void lazyfreeObject(void (*freefn)(void *ptr), void *ptr,
+                    unsigned long effort)
+{
+    thread_task_t *task;
+
+    if (server.lazyfree_pool && server.lazyfree_threshold &&
+        effort > (unsigned long)server.lazyfree_threshold)
+    {
+        task = slabAlloc(SLAB_THREAD_TASK,sizeof(*task));
+        task->handler = freefn;
+        task->data = ptr;
+        task->free = lazyfreeDone;
+        atomicIncr(server.lazyfree_pending_objects,1);
+        if (thread_task_post(server.lazyfree_pool,task) == C_OK) return;
+        atomicDecr(server.lazyfree_pending_objects,1);
+        slabFree(SLAB_THREAD_TASK,task);
+    }
+    freefn(ptr);
+}
+
+static void lazyfreeListJob(void *l) {
+    listRelease(l);
+}
+
+static void lazyfreeDictJob(void *d) {
+    dictRelease(d);
+}
+
+void lazyfreeList(list *l) {
+    lazyfreeObject(lazyfreeListJob,l,listLength(l));
+}
+
+void lazyfreeDict(dict *d) {
+    lazyfreeObject(lazyfreeDictJob,d,dictSize(d));
+}
@@ -1,13 +1,77 @@
 #include "server.h"
 #include "atomicvar.h"
 #include "thread_pool.h"
+#include "slab.h"
+
+/* -----------------------------------------------------------------------------
+ * Server client lists
+ *
+ * A client is in a list if it is its head or has a previous client in it.
+ * -------------------------------------------------------------------------- */
+
+void clientListInit(clientList *l, int id) {
+    l->head = l->tail = NULL;
+    l->len = 0;
+    l->id = id;
+}
+
+int clientListContains(clientList *l, client *c) {
+    return l->head == c || c->links[l->id].prev != NULL;
+}
+
+void clientListAddHead(clientList *l, client *c) {
+    clientLink *link = c->links+l->id;
+
+    link->prev = NULL;
+    link->next = l->head;
+    if (l->head)
+        l->head->links[l->id].prev = c;
+    else
+        l->tail = c;
+    l->head = c;
+    l->len++;
+}
+
+void clientListAddTail(clientList *l, client *c) {
+    clientLink *link = c->links+l->id;
+
+    link->prev = l->tail;
+    link->next = NULL;
+    if (l->tail)
+        l->tail->links[l->id].next = c;
+    else
+        l->head = c;
+    l->tail = c;
+    l->len++;
+}
+
+void clientListDel(clientList *l, client *c) {
+    clientLink *link = c->links+l->id;
+
+    if (link->prev)
+        link->prev->links[l->id].next = link->next;
+    else
+        l->head = link->next;
+    if (link->next)
+        link->next->links[l->id].prev = link->prev;
+    else
+        l->tail = link->prev;
+    link->prev = link->next = NULL;
+    l->len--;
+}
+
+/* Move the tail client to the head, see listRotate(). */
+void clientListRotate(clientList *l) {
+    client *tail = l->tail;
+
+    if (l->len <= 1) return;
+    clientListDel(l,tail);
+    clientListAddHead(l,tail);
+}
 
 void linkClient(client *c) {
-    listAddNodeTail(server.clients, c);
-    /* Note that we remember the linked list node where the client is stored,
-     * this way removing the client in unlinkClient() will not require
-     * a linear scan, but just a constant time operation. */
-    c->client_list_node = listLast(server.clients);
+    clientListAddTail(&server.clients,c);
+    clientsTimeoutAdd(c);
 }
 
 /* Client.reply list dup and free methods. */
@@ -23,17 +87,19 @@ client *createClient(int fd) {
     client *c;
     int err;
 
-    if ((c = zmalloc(sizeof(*c))) == NULL) return NULL;
+    if ((c = slabAlloc(SLAB_CLIENT,sizeof(*c))) == NULL) return NULL;
     if (fd != -1) {
         anetNonBlock(NULL, fd);
         anetEnableTcpNoDelay(NULL, fd);
         if (server.tcpkeepalive)
             anetKeepAlive(NULL, fd, server.tcpkeepalive);
+        if (server.busy_poll_sockets)
+            anetBusyPoll(NULL, fd, server.busy_poll);
         if (aeCreateFileEvent(server.el, fd, AE_READABLE, 
             readMessageFromClient, c) == AE_ERR) 
         {
             close(fd);
-            zfree(c);
+            slabFree(SLAB_CLIENT,c);
             return NULL;
         }
     }
@@ -49,31 +115,34 @@ client *createClient(int fd) {
     c->sentlen = 0;
     listSetFreeMethod(c->reply,freeClientReplyValue);
     listSetDupMethod(c->reply,dupClientReplyValue);
+    c->conflated = dictCreate(&clientConflatedDictType,NULL);
+    c->conflated_nodes = dictCreate(&clientConflatedNodesDictType,NULL);
     c->bufpos = 0;
     c->ctime = c->lastinteraction = server.unixtime;
+    c->timeout_at = 0;
     c->flags = 0;
-    c->client_list_node = NULL;
+    c->inflight = 0;
+    c->waiting_cmd = NULL;
+    c->waiting_since = 0;
+    c->pending_write_since = 0;
+    memset(c->links,0,sizeof(c->links));
+    c->pubsub_channels = dictCreate(&clientPubsubChannelsDictType,NULL);
     pthread_mutex_init(&c->lock, NULL);
     if (fd != -1) linkClient(c);
     return c;
 }
 
 void unlinkClient(client *c) {
-    listNode *ln;
-
     if (c->fd == -1) return;
 
     /* Remove from the list of active clients. */
-    if (c->client_list_node) {
-        listDelNode(server.clients, c->client_list_node);
-        c->client_list_node = NULL;
-    }
+    if (clientListContains(&server.clients,c))
+        clientListDel(&server.clients,c);
+    clientsTimeoutRemove(c);
 
     /* Remove from the list of pending writes if needed. */
     if (c->flags & CLIENT_PENDING_WRITE) {
-        ln = listSearchKey(server.clients_pending_write,c);
-        serverAssert(ln != NULL);
-        listDelNode(server.clients_pending_write,ln);
+        clientListDel(&server.clients_pending_write,c);
         c->flags &= ~CLIENT_PENDING_WRITE;
     }
 
@@ -92,13 +161,81 @@ static void freeClientArgv(client *c) {
 }
 
 void freeClient(client *c) {
-    /* Free data structures. */
-    listRelease(c->reply);
+    int inflight;
+
+    /* A worker may still be running a command of this client: it is freed
+     * once the command is done, see commandTaskDone(). */
+    pthread_mutex_lock(&server.lock);
+    if (c->waiting_cmd) {
+        /* Not in the pool yet, just forget it. */
+        clientListDel(&server.clients_waiting_pool,c);
+        c->waiting_cmd = NULL;
+        c->inflight--;
+    }
+    inflight = c->inflight;
+    if (!inflight && clientListContains(&server.clients_tasks_done,c))
+        clientListDel(&server.clients_tasks_done,c);
+    pthread_mutex_unlock(&server.lock);
+    if (inflight) {
+        freeClientAsync(c);
+        return;
+    }
+
+    /* Stop feeding the replica before anything else. */
+    if (c->flags & CLIENT_REPLICA) replicationUnlinkReplica(c);
+
+    /* Leave all the pubsub channels, so that the other members of presence
+     * channels see this client leaving. */
+    pubsubUnlinkClient(c);
+    lazyfreeDict(c->pubsub_channels);
+    authCacheUnlinkClient(c);
+
+    /* Free data structures, the large ones in background. */
+    lazyfreeList(c->reply);
+    lazyfreeDict(c->conflated_nodes);
+    lazyfreeDict(c->conflated);
     freeClientArgv(c);
 
     unlinkClient(c);
+
+    /* If this client was scheduled for async freeing we need to remove it
+     * from the queue. */
+    if (c->flags & CLIENT_CLOSE_ASAP)
+        clientListDel(&server.clients_to_close,c);
+
     zfree(c->argv);
-    zfree(c);
+    slabFree(SLAB_CLIENT,c);
+}
+
+/* Schedule a client to free it at a safe time in the beforeSleep() function.
+ * This function is useful when we need to terminate a client but we are in
+ * a context where calling freeClient() is not possible, because the client
+ * is being served while server.lock is held. */
+void freeClientAsync(client *c) {
+    if (c->flags & CLIENT_CLOSE_ASAP) return;
+    c->flags |= CLIENT_CLOSE_ASAP;
+    clientListAddTail(&server.clients_to_close,c);
+}
+
+/* Free the clients scheduled for closing, except the ones with commands
+ * still in the thread pool: they stay in the queue until those are done. */
+void freeClientsInAsyncFreeQueue(void) {
+    client *c, *next;
+
+    next = clientListFirst(&server.clients_to_close);
+    while ((c = next) != NULL) {
+        int inflight;
+
+        next = clientListNext(&server.clients_to_close,c);
+        pthread_mutex_lock(&server.lock);
+        inflight = c->inflight;
+        pthread_mutex_unlock(&server.lock);
+        if (inflight) continue;
+
+        c->flags &= ~CLIENT_CLOSE_ASAP;
+        clientListDel(&server.clients_to_close,c);
+        freeClient(c);
+    }
 }
 
 /* Return true if the specified client has pending reply buffers to write to
@@ -119,6 +256,7 @@ int clientHasPendingReplies(client *c) {
  * data should be appended to the output buffers. */
 int prepareClientToWrite(client *c) {
     if (c->fd <= 0) return C_ERR; /* The client is going to close. */
+    if (c->flags & CLIENT_CLOSE_ASAP) return C_ERR;
 
     /* Schedule the client to write the output buffers to the socket only
      * if not already done (there were no pending writes already and the client
@@ -134,7 +272,8 @@ int prepareClientToWrite(client *c) {
          * a system call. We'll only really install the write handler if
          * we'll not be able to write the whole reply at once. */
         c->flags |= CLIENT_PENDING_WRITE;
-        listAddNodeHead(server.clients_pending_write, c);
+        if (server.flush_delay) c->pending_write_since = ustime();
+        clientListAddHead(&server.clients_pending_write,c);
     }
 
     /* Authorize the caller to queue in the output buffer of this client. */
@@ -145,26 +284,93 @@ int prepareClientToWrite(client *c) {
  * Low level functions to add more data to output buffers.
  * -------------------------------------------------------------------------- */
 
-/* We use reply rather than buf normally. So we don't use this function
- * in most cases. */
+/* Try to append the string, terminated by CRLF, to the static output
+ * buffer of the client. Every message queued for a client before its
+ * output gets flushed is appended to the same buffer, so that a burst of
+ * deliveries costs a single write(2). */
 int _addReplyToBuffer(client *c, const char *s, size_t len) {
     size_t available = sizeof(c->buf)-c->bufpos;
 
+    /* If there already are entries in the reply list, we cannot
+     * add anything more to the static buffer. */
+    if (listLength(c->reply) > 0) return C_ERR;
+
     /* Check that the buffer has enough space available for this string. */
-    if (len > available) return C_ERR;
+    if (len+2 > available) return C_ERR;
 
     memcpy(c->buf+c->bufpos, s, len);
-    c->bufpos += len;
+    memcpy(c->buf+c->bufpos+len, "\r\n", 2);
+    c->bufpos += len+2;
     return C_OK;
 }
 
+/* Conflated messages have a node of the reply list each. Return true if
+ * 'ln' holds one, that a newer message with the same key may remove. */
+static int _replyNodeIsConflated(client *c, listNode *ln) {
+    return dictSize(c->conflated_nodes) &&
+           dictFind(c->conflated_nodes,ln) != NULL;
+}
+
+/* Called when the node 'ln' of the reply list is sent. */
+static void _unlinkConflatedNode(client *c, listNode *ln) {
+    sds key = dictFetchValue(c->conflated_nodes,ln);
+
+    dictDelete(c->conflated_nodes,ln);
+    dictDelete(c->conflated,key);
+}
+
 void _addReplyStringToList(client *c, const char *s, size_t len) {
-    sds node = sdsnewlen(s,len);
-    node = sdscatlen(node, "\r\n", 2);
-    listAddNodeTail(c->reply,node);
+    listNode *ln = listLast(c->reply);
+    sds tail = ln ? listNodeValue(ln) : NULL;
+
+    /* Coalesce small replies into the last node while it is not larger
+     * than PROTO_REPLY_CHUNK_BYTES, instead of creating a node (and doing
+     * a write) per message. A node holding a conflated message may still
+     * be replaced, so it is left alone. */
+    if (tail && sdslen(tail)+len+2 <= PROTO_REPLY_CHUNK_BYTES &&
+        !_replyNodeIsConflated(c,ln))
+    {
+        tail = sdscatlen(tail,s,len);
+        tail = sdscatlen(tail,"\r\n",2);
+        listNodeValue(ln) = tail;
+    } else {
+        sds node = sdsnewlen(s,len);
+        node = sdscatlen(node, "\r\n", 2);
+        listAddNodeTail(c->reply,node);
+    }
     c->reply_bytes += len+2;
 }
 
+/* Queue a conflated message: if a message with the same key is still
+ * waiting to be sent it is dropped, so that the output of a client that
+ * can't keep up is bounded by the number of keys rather than by the
+ * publishing rate. The new message goes at the end of the replies like any
+ * other, so the client still gets every message in the publishing order. */
+void _addReplyConflated(client *c, sds key, const char *s, size_t len) {
+    sds msg = sdsnewlen(s,len);
+    dictEntry *de;
+
+    msg = sdscatlen(msg,"\r\n",2);
+    if ((de = dictFind(c->conflated,key)) != NULL) {
+        listNode *ln = dictGetVal(de);
+
+        /* A message partly written to the socket must be sent till the
+         * end. */
+        dictDelete(c->conflated_nodes,ln);
+        if (ln != listFirst(c->reply) || c->bufpos || c->sentlen == 0) {
+            c->reply_bytes -= sdslen(listNodeValue(ln));
+            listDelNode(c->reply,ln);
+            server.stat_conflated_messages++;
+        }
+    } else {
+        de = dictAddRaw(c->conflated,sdsdup(key),NULL);
+    }
+    listAddNodeTail(c->reply,msg);
+    dictSetVal(c->conflated,de,listLast(c->reply));
+    dictAdd(c->conflated_nodes,listLast(c->reply),dictGetKey(de));
+    c->reply_bytes += sdslen(msg);
+}
+
 /* -----------------------------------------------------------------------------
  * Higher level functions to queue data on the client output buffer.
  * The following functions are the ones that commands implementations will call.
@@ -180,7 +386,8 @@ void addReplySds(client *c, sds s) {
         sdsfree(s);
         return;
     }
-    _addReplyStringToList(c,s,sdslen(s));
+    if (_addReplyToBuffer(c,s,sdslen(s)) != C_OK)
+        _addReplyStringToList(c,s,sdslen(s));
     pthread_mutex_unlock(&server.lock);
     sdsfree(s);
 }
@@ -195,7 +402,34 @@ void addReplyString(client *c, const char *s, size_t len) {
         pthread_mutex_unlock(&server.lock);
         return;
     }
-    _addReplyStringToList(c,s,len);
+    if (_addReplyToBuffer(c,s,len) != C_OK)
+        _addReplyStringToList(c,s,len);
+    pthread_mutex_unlock(&server.lock);
+}
+
+/* Queue 'len' bytes of protocol as they are, without the CRLF the other
+ * functions terminate every reply with: used to restore the output of a
+ * client handed off by another process. */
+void addReplyProto(client *c, const char *s, size_t len) {
+    pthread_mutex_lock(&server.lock);
+    if (prepareClientToWrite(c) != C_OK) {
+        pthread_mutex_unlock(&server.lock);
+        return;
+    }
+    listAddNodeTail(c->reply,sdsnewlen(s,len));
+    c->reply_bytes += len;
+    pthread_mutex_unlock(&server.lock);
+}
+
+/* Like addReplyString() but the message only replaces any message with
+ * the same conflation key the client did not receive yet. */
+void addReplyConflated(client *c, sds key, const char *s, size_t len) {
+    pthread_mutex_lock(&server.lock);
+    if (prepareClientToWrite(c) != C_OK) {
+        pthread_mutex_unlock(&server.lock);
+        return;
+    }
+    _addReplyConflated(c,key,s,len);
     pthread_mutex_unlock(&server.lock);
 }
 
@@ -235,7 +469,7 @@ int writeToClient(int fd, client *c, int handler_installed) {
 
     while(clientHasPendingReplies(c)) {
         if (c->bufpos > 0) {
-            nwritten = write(fd, c->buf, c->bufpos);
+            nwritten = write(fd, c->buf+c->sentlen, c->bufpos-c->sentlen);
             if (nwritten <= 0) break;
             c->sentlen += nwritten;
             totwritten += nwritten;
@@ -262,6 +496,8 @@ int writeToClient(int fd, client *c, int handler_installed) {
 
             /* If we fully sent the object on head go to the next one */
             if (c->sentlen == objlen) {
+                if (_replyNodeIsConflated(c,listFirst(c->reply)))
+                    _unlinkConflatedNode(c,listFirst(c->reply));
                 listDelNode(c->reply,listFirst(c->reply));
                 c->sentlen = 0;
                 c->reply_bytes -= objlen;
@@ -279,7 +515,7 @@ int writeToClient(int fd, client *c, int handler_installed) {
         } else {
             serverLog(LL_VERBOSE,
                 "Error writing to client: %s", strerror(errno));
-            freeClient(c);
+            freeClientAsync(c);
             return C_ERR;
         }
     }
@@ -296,26 +532,52 @@ int writeToClient(int fd, client *c, int handler_installed) {
 void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     UNUSED(el);
     UNUSED(mask);
+    pthread_mutex_lock(&server.lock);
     writeToClient(fd, privdata, 1);
+    pthread_mutex_unlock(&server.lock);
+}
+
+/* Wakes up the event loop when there are clients whose output is being
+ * held back by server.flush_delay, so that beforeSleep() flushes them. */
+static int flushDelayedWritesProc(struct aeEventLoop *eventLoop, long long id,
+                                  void *clientData)
+{
+    UNUSED(eventLoop);
+    UNUSED(id);
+    UNUSED(clientData);
+    server.flush_timer_id = -1;
+    return AE_NOMORE;
 }
 
 /* This function is called just before entering the event loop, in the hope
  * we can just write the replies to the client output buffer without any
  * need to use a syscall in order to install the writable event handler,
- * get it called, and so forth. */
+ * get it called, and so forth.
+ *
+ * When server.flush_delay is set, clients are only flushed once their
+ * first pending message is at least that old, so that the messages
+ * published to them in the meantime go out with the same write. */
 int handleClientsWithPendingWrites(void) {
-    listIter li;
-    listNode *ln;
-    
+    client *c, *next;
+    long long now;
+    int delayed = 0;
+
     pthread_mutex_lock(&server.lock);
 
-    int processed = listLength(server.clients_pending_write);
+    int processed = clientListLength(&server.clients_pending_write);
+    now = server.flush_delay ? ustime() : 0;
 
-    listRewind(server.clients_pending_write, &li);
-    while((ln = listNext(&li)) != NULL) {
-        client *c = listNodeValue(ln);
+    next = clientListFirst(&server.clients_pending_write);
+    while ((c = next) != NULL) {
+        next = clientListNext(&server.clients_pending_write,c);
+        if (server.flush_delay &&
+            now - c->pending_write_since < server.flush_delay)
+        {
+            delayed++;
+            continue;
+        }
         c->flags &= ~CLIENT_PENDING_WRITE;
-        listDelNode(server.clients_pending_write,ln);
+        clientListDel(&server.clients_pending_write,c);
 
         /* Try to write buffers to the client socket. */
         if (writeToClient(c->fd,c,0) == C_ERR) continue;
@@ -332,15 +594,162 @@ int handleClientsWithPendingWrites(void) {
         }
     }
 
+    if (delayed && server.flush_timer_id == -1)
+        server.flush_timer_id = aeCreateTimeEvent(server.el,1,
+            flushDelayedWritesProc,NULL,NULL);
+
     pthread_mutex_unlock(&server.lock);
 
-    return processed;
+    return processed - delayed;
 }
 
-// static void thread_func(void *data) {
-//     struct pusherCommand *cmd = (struct pusherCommand*)data;
-//     cmd->proc(1);
-// }
+/* -----------------------------------------------------------------------------
+ * Commands run by the thread pool
+ *
+ * We stop reading from a client while one of its commands is in the thread
+ * pool, so that its commands run in order and c->argv is never replaced
+ * under a worker. When the command is done the worker puts the client in
+ * server.clients_tasks_done and wakes up the event loop through
+ * server.tasks_done_pipe, which reads from the client again, or frees it if
+ * it was closed in the meantime.
+ *
+ * This is also how the thread pool applies backpressure: when its queue is
+ * full the command waits in the client, which is not read meanwhile, until
+ * the queue goes under CONFIG_DEFAULT_TASKS_LOW_WATER.
+ * -------------------------------------------------------------------------- */
+
+/* Called by the worker once the command of client 'data' ran. */
+static void commandTaskDone(void *data) {
+    client *c = data;
+    int wakeup = 0;
+
+    pthread_mutex_lock(&server.lock);
+    if (--c->inflight == 0) {
+        wakeup = clientListLength(&server.clients_tasks_done) == 0;
+        clientListAddTail(&server.clients_tasks_done,c);
+    }
+    pthread_mutex_unlock(&server.lock);
+    if (wakeup && write(server.tasks_done_pipe[1],"x",1) == -1) {
+        /* The pipe is full, so the event loop has a wakeup pending. */
+    }
+}
+
+static void tasksDoneHandler(aeEventLoop *el, int fd, void *privdata,
+                             int mask)
+{
+    char buf[64];
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    while (read(fd,buf,sizeof(buf)) > 0);
+    pthread_mutex_lock(&server.lock);
+    while (clientListLength(&server.clients_tasks_done)) {
+        client *c = clientListFirst(&server.clients_tasks_done);
+
+        clientListDel(&server.clients_tasks_done,c);
+        if (c->fd == -1 || (c->flags & CLIENT_CLOSE_ASAP)) continue;
+        aeCreateFileEvent(el,c->fd,AE_READABLE,readMessageFromClient,c);
+    }
+    pthread_mutex_unlock(&server.lock);
+}
+
+void tasksDoneInit(void) {
+    if (pipe(server.tasks_done_pipe) == -1) {
+        serverLog(LL_WARNING,"Can't create the tasks done pipe: %s",
+            strerror(errno));
+        exit(1);
+    }
+    anetNonBlock(NULL,server.tasks_done_pipe[0]);
+    anetNonBlock(NULL,server.tasks_done_pipe[1]);
+    if (aeCreateFileEvent(server.el,server.tasks_done_pipe[0],AE_READABLE,
+        tasksDoneHandler,NULL) == AE_ERR)
+    {
+        serverPanic("Unrecoverable error creating the tasks done event.");
+    }
+}
+
+/* Post the command 'cmd' of client 'c', already counted in c->inflight,
+ * to the thread pool. */
+static int postClientTask(client *c, struct pusherCommand *cmd) {
+    thread_task_t *task;
+
+    if ((task = slabAlloc(SLAB_THREAD_TASK,sizeof(*task))) == NULL)
+        return C_ERR;
+    task->handler = (void (*)(void *))cmd->proc;
+    task->data = c;
+    task->free = commandTaskDone;
+    if (thread_task_post(server.tpool,task) == C_ERR) {
+        slabFree(SLAB_THREAD_TASK,task);
+        return C_ERR;
+    }
+    server.stat_offloaded_commands++;
+    return C_OK;
+}
+
+/* Post the commands that were waiting for room in the thread pool, in the
+ * order they came, once the queue went under the low-water mark. Called
+ * before every sleep: the workers wake us up when they finish commands. */
+void postWaitingCommands(void) {
+    long long queued, now;
+
+    if (clientListLength(&server.clients_waiting_pool) == 0) return;
+    atomicGet(server.tpool->queued,queued);
+    if (queued > CONFIG_DEFAULT_TASKS_LOW_WATER) return;
+
+    now = ustime();
+    while (clientListLength(&server.clients_waiting_pool)) {
+        client *c = clientListFirst(&server.clients_waiting_pool);
+
+        if (postClientTask(c,c->waiting_cmd) == C_ERR) break;
+        pthread_mutex_lock(&server.lock);
+        clientListDel(&server.clients_waiting_pool,c);
+        c->waiting_cmd = NULL;
+        pthread_mutex_unlock(&server.lock);
+        server.stat_reads_paused_us += now-c->waiting_since;
+    }
+}
+
+/* Run the command of 'c' in the thread pool, not reading from the client
+ * until it is done. When the queue of the pool is full, or other clients
+ * wait already, the command waits in server.clients_waiting_pool instead:
+ * only this client stops being read until there is room, the others go
+ * on normally. */
+static void postClientCommand(client *c, struct pusherCommand *cmd) {
+    long long queued;
+
+    aeDeleteFileEvent(server.el,c->fd,AE_READABLE);
+    pthread_mutex_lock(&server.lock);
+    c->inflight++;
+    pthread_mutex_unlock(&server.lock);
+
+    atomicGet(server.tpool->queued,queued);
+    if (clientListLength(&server.clients_waiting_pool) == 0 &&
+        queued < server.tpool->maxtasks &&
+        postClientTask(c,cmd) == C_OK) return;
+
+    pthread_mutex_lock(&server.lock);
+    c->waiting_cmd = cmd;
+    c->waiting_since = ustime();
+    clientListAddTail(&server.clients_waiting_pool,c);
+    pthread_mutex_unlock(&server.lock);
+    server.stat_reads_pauses++;
+}
+
+/* Return 1 if 'cmd' is cheap enough, with these arguments, to run on the
+ * event loop rather than paying for a handoff to the thread pool. It must
+ * also not overtake a command of the same client still in the pool: then
+ * it is posted behind it. */
+static int commandRunsInline(client *c, struct pusherCommand *cmd) {
+    int inflight;
+
+    if (!server.inline_commands || !(cmd->flags & CMD_INLINE)) return 0;
+    if ((cmd->flags & CMD_AUTH) && pubsubChannelRequiresAuth(c->argv[1]))
+        return 0;
+    pthread_mutex_lock(&server.lock);
+    inflight = c->inflight;
+    pthread_mutex_unlock(&server.lock);
+    return inflight == 0;
+}
 
 #define READ_MESSAGE_LENGTH (16*1024)
 void readMessageFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -349,14 +758,24 @@ void readMessageFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     char readbuf[READ_MESSAGE_LENGTH];
     struct pusherCommand *cmd;
     sds *argv;
-    thread_task_t *task;
+    int argc;
     UNUSED(el);
     UNUSED(mask);
 
     nread = read(fd, readbuf, READ_MESSAGE_LENGTH);
+    if (nread == -1) {
+        if (errno == EAGAIN) return;
+        serverLog(LL_VERBOSE, "Reading from client: %s",strerror(errno));
+        freeClient(c);
+        return;
+    } else if (nread == 0) {
+        serverLog(LL_VERBOSE, "Client closed connection");
+        freeClient(c);
+        return;
+    }
 
     /* remove CRLF */
-    if (!strncmp(readbuf+nread-2, "\r\n", 2)) 
+    if (nread >= 2 && !strncmp(readbuf+nread-2, "\r\n", 2)) 
         nread -= 2;
 
     if (nread <= 0) 
@@ -364,8 +783,10 @@ void readMessageFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
 
     /* build argc and argv */
 
-    argv = sdssplitlen(readbuf, nread, " ", 1, &c->argc);
-    if (c->argc) zfree(c->argv);
+    argv = sdssplitlen(readbuf, nread, " ", 1, &argc);
+    freeClientArgv(c);
+    zfree(c->argv);
+    c->argc = argc;
     c->argv = argv;
     if ((cmd = lookupCommand(c->argv[0])) == NULL) {
         addReplyErrorFormat(c,"ERR unknown command '%s'",
@@ -378,10 +799,11 @@ void readMessageFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
         return;
     }
 
-    if ((task = zmalloc(sizeof(*task))) == NULL) return;
-    task->handler = cmd->proc;
-    task->data = c;
-    task->free = NULL;
-    thread_task_post(server.tpool, task);
-    // cmd->proc(c);
+    if (commandRunsInline(c,cmd)) {
+        server.stat_inline_commands++;
+        cmd->proc(c);
+        return;
+    }
+
+    postClientCommand(c,cmd);
 }
@@ -1,6 +1,733 @@
 #include "server.h"
+#include "cluster.h"
+#include "atomicvar.h"
 
+/*-----------------------------------------------------------------------------
+ * Pubsub low level API
+ *
+ * Commands run in the thread pool, so the channels and the clients
+ * subscriptions may be accessed by many threads at once. Channels live in
+ * server.pubsub_shards, each shard protected by its own lock, while the
+ * subscriptions of a client are protected by the client lock. When both
+ * are needed the client lock is always taken first.
+ *----------------------------------------------------------------------------*/
+
+void pubsubInitShards(void) {
+    unsigned long j;
+
+    server.pubsub_shards =
+        zmalloc(sizeof(pubsubShard)*server.pubsub_shards_count);
+    for (j = 0; j < server.pubsub_shards_count; j++) {
+        pthread_mutex_init(&server.pubsub_shards[j].lock,NULL);
+        server.pubsub_shards[j].channels =
+            dictCreate(&pubsubChannelsDictType,NULL);
+    }
+}
+
+/* Take, or release, the locks of all the shards, in order. */
+void pubsubLockAllShards(int lock) {
+    unsigned long j;
+
+    for (j = 0; j < server.pubsub_shards_count; j++) {
+        if (lock)
+            pthread_mutex_lock(&server.pubsub_shards[j].lock);
+        else
+            pthread_mutex_unlock(&server.pubsub_shards[j].lock);
+    }
+}
+
+/* Return the shard 'channel' belongs to. */
+static pubsubShard *pubsubShardOf(sds channel) {
+    uint64_t hash = dictGenHashFunction(channel,sdslen(channel));
+
+    return server.pubsub_shards+(hash & (server.pubsub_shards_count-1));
+}
+
+void freePubsubChannel(pubsubChannel *ch) {
+    listRelease(ch->clients);
+    if (ch->members) dictRelease(ch->members);
+    sdsfree(ch->members_cache);
+    sdsfree(ch->name);
+    zfree(ch);
+}
+
+void freePresenceMember(presenceMember *m) {
+    sdsfree(m->info);
+    zfree(m);
+}
+
+void freePubsubSubscription(pubsubSubscription *sub) {
+    sdsfree(sub->user_id);
+    zfree(sub);
+}
+
+static int historyReplay(client *c, sds channel, long long since);
+
+int pubsubIsPresenceChannel(sds channel) {
+    return sdslen(channel) > PRESENCE_CHANNEL_PREFIX_LEN &&
+           !memcmp(channel,PRESENCE_CHANNEL_PREFIX,PRESENCE_CHANNEL_PREFIX_LEN);
+}
+
+static pubsubChannel *createPubsubChannel(sds name) {
+    pubsubChannel *ch = zmalloc(sizeof(*ch));
+
+    ch->name = sdsdup(name);
+    ch->clients = listCreate();
+    ch->members = pubsubIsPresenceChannel(name) ?
+                  dictCreate(&presenceMembersDictType,NULL) : NULL;
+    ch->members_cache = NULL;
+    return ch;
+}
+
+/* Return the message line sent to the subscribers. With the history
+ * enabled it ends with the message sequence number, that the subscribers
+ * give to RESUME after a reconnection. */
+static sds pubsubMessageLine(sds channel, sds message, long long seq) {
+    sds msg = sdscatfmt(sdsempty(),"message %S %S",channel,message);
+
+    if (server.history_size && seq != -1) msg = sdscatfmt(msg," %I",seq);
+    return msg;
+}
+
+/* Conflation keys are per channel, while clients keep their pending
+ * conflated messages all together. */
+static sds pubsubConflationKey(sds channel, sds key) {
+    return key ? sdscatfmt(sdsempty(),"%S %S",channel,key) : NULL;
+}
+
+/* Send a message to every client subscribed to 'ch' but 'skip'. If 'key'
+ * is not NULL the message is conflated: subscribers that did not receive
+ * the previous message with the same key only get this one. */
+static void notifyChannel(pubsubChannel *ch, client *skip, sds msg, sds key) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(ch->clients,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        client *c = listNodeValue(ln);
+
+        if (c == skip) continue;
+        if (key)
+            addReplyConflated(c,key,msg,sdslen(msg));
+        else
+            addReplyString(c,msg,sdslen(msg));
+    }
+}
+
+/* Append one member to the encoded member list. */
+static sds catPresenceMember(sds s, sds user_id, presenceMember *m) {
+    if (sdslen(s)) s = sdscatlen(s,"\r\n",2);
+    s = sdscatsds(s,user_id);
+    if (sdslen(m->info)) {
+        s = sdscatlen(s," ",1);
+        s = sdscatsds(s,m->info);
+    }
+    return s;
+}
+
+/* Return the member list of a presence channel, one "<user id> <info>"
+ * line per member. The list is cached in the channel, so that subscribing
+ * to a crowded room does not cost a full scan of the members every time:
+ * joins append to the cached list, leaves invalidate it. */
+static sds presenceMembersList(pubsubChannel *ch) {
+    dictIterator *di;
+    dictEntry *de;
+
+    if (ch->members_cache) return ch->members_cache;
+
+    ch->members_cache = sdsempty();
+    di = dictGetIterator(ch->members);
+    while ((de = dictNext(di)) != NULL)
+        ch->members_cache = catPresenceMember(ch->members_cache,
+            dictGetKey(de),dictGetVal(de));
+    dictReleaseIterator(di);
+    return ch->members_cache;
+}
+
+/* Add a connection of 'user_id' to the members of 'ch'. The other members
+ * are notified only if this is the first connection of the user, and
+ * 'notify' is true. */
+static void presenceMemberJoin(pubsubChannel *ch, client *c, sds user_id,
+                               sds user_info, int notify)
+{
+    dictEntry *de = dictFind(ch->members,user_id);
+    presenceMember *m;
+    sds msg;
+
+    if (de) {
+        m = dictGetVal(de);
+        m->refcount++;
+        return;
+    }
+
+    m = zmalloc(sizeof(*m));
+    m->info = user_info ? sdsdup(user_info) : sdsempty();
+    m->refcount = 1;
+    serverAssert(dictAdd(ch->members,sdsdup(user_id),m) == DICT_OK);
+    if (ch->members_cache)
+        ch->members_cache = catPresenceMember(ch->members_cache,user_id,m);
+
+    if (!notify) return;
+    msg = sdscatfmt(sdsempty(),"member_added %S %S",ch->name,user_id);
+    if (sdslen(m->info)) msg = sdscatfmt(msg," %S",m->info);
+    notifyChannel(ch,c,msg,NULL);
+    sdsfree(msg);
+}
+
+/* Remove a connection of 'user_id' from the members of 'ch'. The other
+ * members are notified only if this was the last connection of the user. */
+static void presenceMemberLeave(pubsubChannel *ch, client *c, sds user_id) {
+    dictEntry *de = dictFind(ch->members,user_id);
+    presenceMember *m;
+    sds msg;
+
+    if (de == NULL) return;
+    m = dictGetVal(de);
+    if (--m->refcount) return;
+
+    sdsfree(ch->members_cache);
+    ch->members_cache = NULL;
+
+    msg = sdscatfmt(sdsempty(),"member_removed %S %S",ch->name,user_id);
+    dictDelete(ch->members,user_id);
+    notifyChannel(ch,c,msg,NULL);
+    sdsfree(msg);
+}
+
+/* Subscribe a client to a channel. Returns 1 if the operation succeeded, or
+ * 0 if the client was already subscribed to that channel. The caller must
+ * hold both the client lock and the lock of 'shard'. */
+static int subscribeChannel(client *c, pubsubShard *shard, sds channel,
+                            sds user_id, sds user_info, int notify)
+{
+    dictEntry *de;
+    pubsubChannel *ch;
+    pubsubSubscription *sub;
+    int retval = 0;
+
+    /* Add the channel to the client -> channels hash dict */
+    if (dictFind(c->pubsub_channels,channel) == NULL) {
+        retval = 1;
+        /* Add the client to the channel -> list of clients hash table */
+        de = dictFind(shard->channels,channel);
+        if (de == NULL) {
+            ch = createPubsubChannel(channel);
+            serverAssert(dictAdd(shard->channels,ch->name,ch) == DICT_OK);
+            clusterPropagateInterest(channel,1);
+        } else {
+            ch = dictGetVal(de);
+        }
+        listAddNodeTail(ch->clients,c);
+
+        sub = zmalloc(sizeof(*sub));
+        sub->node = listLast(ch->clients);
+        sub->user_id = ch->members ? sdsdup(user_id) : NULL;
+        serverAssert(dictAdd(c->pubsub_channels,sdsdup(channel),sub) ==
+                     DICT_OK);
+
+        if (ch->members) presenceMemberJoin(ch,c,user_id,user_info,notify);
+    }
+    return retval;
+}
+
+/* Remove a client from the clients of 'channel', and free the channel if
+ * it was the last one. The subscription itself is left to the caller. */
+static void unlinkSubscription(client *c, sds channel,
+                               pubsubSubscription *sub)
+{
+    pubsubShard *shard = pubsubShardOf(channel);
+    dictEntry *de;
+    pubsubChannel *ch;
+
+    pthread_mutex_lock(&shard->lock);
+    de = dictFind(shard->channels,channel);
+    serverAssert(de != NULL);
+    ch = dictGetVal(de);
+    listDelNode(ch->clients,sub->node);
+    if (ch->members) presenceMemberLeave(ch,c,sub->user_id);
+
+    /* Free the channel if this was the latest client, otherwise it will
+     * be possible to abuse pusher PUBSUB creating millions of channels. */
+    if (listLength(ch->clients) == 0) {
+        dictDelete(shard->channels,channel);
+        clusterPropagateInterest(channel,0);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/* Unsubscribe a client from a channel. Returns 1 if the operation succeeded,
+ * or 0 if the client was not subscribed to the specified channel. The
+ * caller must hold the client lock. */
+static int unsubscribeChannel(client *c, sds channel, int notify) {
+    dictEntry *de;
+    int retval = 0;
+
+    /* Protect the sds, it may be the same key we are going to remove from
+     * the client dict. */
+    channel = sdsdup(channel);
+    if ((de = dictFind(c->pubsub_channels,channel)) != NULL) {
+        retval = 1;
+        unlinkSubscription(c,channel,dictGetVal(de));
+        dictDelete(c->pubsub_channels,channel);
+    }
+    /* Notify the client */
+    if (notify) {
+        sds msg = sdscatfmt(sdsempty(),"unsubscribe %S %u",channel,
+            (unsigned int)dictSize(c->pubsub_channels));
+        addReplySds(c,msg);
+    }
+    sdsfree(channel);
+    return retval;
+}
+
+/* Subscribe 'c' to 'channel' and reply with the subscription. If 'since'
+ * is not -1 the client also gets the messages of the channel with a
+ * sequence number greater than 'since' still in the history, or
+ * "resume_failed" if some of them are gone. The history is replayed with
+ * the channel locked, so no live message can come before it. */
+int pubsubSubscribeChannel(client *c, sds channel, sds user_id, sds user_info,
+                           long long since)
+{
+    pubsubShard *shard = pubsubShardOf(channel);
+    pubsubChannel *ch;
+    sds msg;
+    int retval;
+
+    pthread_mutex_lock(&c->lock);
+    pthread_mutex_lock(&shard->lock);
+    retval = subscribeChannel(c,shard,channel,user_id,user_info,1);
+
+    /* Notify the client */
+    msg = sdscatfmt(sdsempty(),"subscribe %S %u",channel,
+        (unsigned int)dictSize(c->pubsub_channels));
+    addReplySds(c,msg);
+    ch = dictFetchValue(shard->channels,channel);
+    if (ch->members) {
+        sds members = presenceMembersList(ch);
+
+        msg = sdscatfmt(sdsempty(),"members %S %u",channel,
+            (unsigned int)dictSize(ch->members));
+        addReplySds(c,msg);
+        if (sdslen(members)) addReplyString(c,members,sdslen(members));
+    }
+    if (since != -1 && historyReplay(c,channel,since) == C_ERR)
+        addReplySds(c,sdscatfmt(sdsempty(),"resume_failed %S",channel));
+    pthread_mutex_unlock(&shard->lock);
+    pthread_mutex_unlock(&c->lock);
+    return retval;
+}
+
+/* Append to 's' the number of channels 'c' is subscribed to, then the
+ * channel, user id and user info of each one, as handoffCatField() fields
+ * (empty when missing), so that the subscriptions can be moved to another
+ * process with pubsubRestoreSubscription(). */
+sds pubsubDumpSubscriptions(client *c, sds s) {
+    dictIterator *di;
+    dictEntry *de;
+    char buf[32];
+
+    pthread_mutex_lock(&c->lock);
+    s = handoffCatField(s,buf,ll2string(buf,sizeof(buf),
+        dictSize(c->pubsub_channels)));
+    di = dictGetIterator(c->pubsub_channels);
+    while ((de = dictNext(di)) != NULL) {
+        sds channel = dictGetKey(de);
+        pubsubSubscription *sub = dictGetVal(de);
+
+        s = handoffCatField(s,channel,sdslen(channel));
+        if (sub->user_id) {
+            pubsubShard *shard = pubsubShardOf(channel);
+            pubsubChannel *ch;
+            presenceMember *m;
+
+            pthread_mutex_lock(&shard->lock);
+            ch = dictFetchValue(shard->channels,channel);
+            m = dictFetchValue(ch->members,sub->user_id);
+            s = handoffCatField(s,sub->user_id,sdslen(sub->user_id));
+            s = handoffCatField(s,m->info,sdslen(m->info));
+            pthread_mutex_unlock(&shard->lock);
+        } else {
+            s = handoffCatField(s,"",0);
+            s = handoffCatField(s,"",0);
+        }
+    }
+    dictReleaseIterator(di);
+    pthread_mutex_unlock(&c->lock);
+    return s;
+}
+
+/* Subscribe 'c' to a channel it was subscribed to in the process that
+ * handed it off: neither the client nor the other members of presence
+ * channels are notified, as far as they know nothing happened. */
+void pubsubRestoreSubscription(client *c, sds channel, sds user_id,
+                               sds user_info)
+{
+    pubsubShard *shard = pubsubShardOf(channel);
+
+    if (pubsubIsPresenceChannel(channel) && user_id == NULL) return;
+
+    pthread_mutex_lock(&c->lock);
+    pthread_mutex_lock(&shard->lock);
+    subscribeChannel(c,shard,channel,user_id,user_info,0);
+    pthread_mutex_unlock(&shard->lock);
+    pthread_mutex_unlock(&c->lock);
+}
+
+int pubsubUnsubscribeChannel(client *c, sds channel, int notify) {
+    int retval;
+
+    pthread_mutex_lock(&c->lock);
+    retval = unsubscribeChannel(c,channel,notify);
+    pthread_mutex_unlock(&c->lock);
+    return retval;
+}
+
+/* Unsubscribe from all the channels. Return the number of channels the
+ * client was subscribed to. */
+int pubsubUnsubscribeAllChannels(client *c, int notify) {
+    dictIterator *di;
+    dictEntry *de;
+    int count = 0;
+
+    pthread_mutex_lock(&c->lock);
+    di = dictGetSafeIterator(c->pubsub_channels);
+    while ((de = dictNext(di)) != NULL) {
+        sds channel = dictGetKey(de);
+
+        count += unsubscribeChannel(c,channel,notify);
+    }
+    /* We were subscribed to nothing? Still reply to the client. */
+    if (notify && count == 0) addReplySds(c,sdsnew("unsubscribe"));
+    dictReleaseIterator(di);
+    pthread_mutex_unlock(&c->lock);
+    return count;
+}
+
+/* Remove a client being freed from all its channels, leaving its own
+ * subscriptions dict alone, so that the caller can release it at once
+ * (possibly lazily) instead of deleting the subscriptions one by one. The
+ * other members of presence channels still see the client leaving. */
+void pubsubUnlinkClient(client *c) {
+    dictIterator *di;
+    dictEntry *de;
+
+    pthread_mutex_lock(&c->lock);
+    di = dictGetIterator(c->pubsub_channels);
+    while ((de = dictNext(di)) != NULL)
+        unlinkSubscription(c,dictGetKey(de),dictGetVal(de));
+    dictReleaseIterator(di);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Publish a message. If 'key' is not NULL the message is conflated with
+ * the other messages published to the channel with the same key. 'seq' is
+ * the sequence number of the message, or 0 to use the next one: only the
+ * messages received from the master have one already. With -1 the message
+ * is only delivered, without a sequence number nor going in the history. */
+int pubsubPublishMessage(sds channel, sds message, sds key, long long seq) {
+    pubsubShard *shard = pubsubShardOf(channel);
+    int receivers = 0;
+    dictEntry *de;
+
+    pthread_mutex_lock(&shard->lock);
+    /* The message goes in the history even without subscribers, the ones
+     * reconnecting may ask for it. Without a history nor replicas it just
+     * takes the next sequence number, and the history lock is left alone:
+     * replicas are only added holding the locks of all the shards. */
+    if (seq == -1) {
+        /* Delivery only. */
+    } else if (seq == 0 && server.history_size == 0 &&
+               clientListLength(&server.replicas) == 0)
+    {
+        atomicGetIncr(server.history_seq,seq,1);
+        seq++;
+    } else {
+        seq = historyAdd(channel,message,key,seq);
+    }
+
+    /* Send to clients listening for that channel */
+    de = dictFind(shard->channels,channel);
+    if (de) {
+        pubsubChannel *ch = dictGetVal(de);
+        sds msg = pubsubMessageLine(channel,message,seq);
+
+        key = pubsubConflationKey(channel,key);
+        notifyChannel(ch,NULL,msg,key);
+        receivers = listLength(ch->clients);
+        sdsfree(msg);
+        sdsfree(key);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return receivers;
+}
+
+/*-----------------------------------------------------------------------------
+ * Channels history
+ *
+ * The latest server.history_size messages published on any channel are
+ * kept in a circular buffer, so that subscribers can RESUME after a
+ * reconnection without losing messages, and replicas can SYNC from where
+ * they left. Sequence numbers are global and contiguous: the message with
+ * sequence number N is at N % history_size, and a gap in the numbers
+ * received from the master throws the whole history away.
+ *
+ * The history lock is always taken after the shard locks. The sequence
+ * number is only updated atomically, since PUBLISH takes the next one
+ * without the history lock when there is nothing else to do.
+ *----------------------------------------------------------------------------*/
+
+void historyInit(void) {
+    server.history = server.history_size ?
+        zcalloc(sizeof(historyEntry)*server.history_size) : NULL;
+    server.history_len = 0;
+    server.history_seq = 0;
+}
+
+static void historyFreeEntry(historyEntry *he) {
+    sdsfree(he->channel);
+    sdsfree(he->message);
+    sdsfree(he->key);
+    he->channel = he->message = he->key = NULL;
+}
+
+/* A history thrown away, to free in the lazyfree thread. */
+typedef struct historyFreeJob {
+    historyEntry *entries;
+    long long size;
+} historyFreeJob;
+
+static void historyFreeJobProc(void *ptr) {
+    historyFreeJob *job = ptr;
+    long long j;
+
+    for (j = 0; j < job->size; j++) historyFreeEntry(job->entries+j);
+    zfree(job->entries);
+    zfree(job);
+}
+
+/* Throw away all the messages. A large history is swapped with an empty
+ * one and freed by the lazyfree thread, as we hold the lock of the shard
+ * the message being published belongs to. */
+static void historyClear(void) {
+    historyFreeJob *job;
+
+    if (server.history_len == 0) return;
+    job = zmalloc(sizeof(*job));
+    job->entries = server.history;
+    job->size = server.history_size;
+    lazyfreeObject(historyFreeJobProc,job,server.history_len);
+    server.history = zcalloc(sizeof(historyEntry)*server.history_size);
+    server.history_len = 0;
+}
+
+/* Free up to 'count' of the oldest messages of the history, to get some
+ * memory back. Returns the number of messages freed. */
+long long historyEvictOldest(long long count) {
+    long long evicted = 0;
+
+    pthread_mutex_lock(&server.history_lock);
+    while (evicted < count && server.history_len) {
+        long long oldest = server.history_seq-server.history_len+1;
+
+        historyFreeEntry(server.history+(oldest % server.history_size));
+        server.history_len--;
+        evicted++;
+    }
+    server.stat_evicted_messages += evicted;
+    pthread_mutex_unlock(&server.history_lock);
+    return evicted;
+}
+
+/* Add a message to the history and feed it to the replicas. Returns the
+ * sequence number of the message, assigned here if 'seq' is 0. The copies
+ * of the message are made, and the entry it replaces freed, out of the
+ * history lock. */
+long long historyAdd(sds channel, sds message, sds key, long long seq) {
+    historyEntry *he, new, old = {0};
+    long long last;
+
+    new.channel = channel;
+    new.message = message;
+    new.key = key;
+    if (server.history_size) {
+        new.channel = sdsdup(channel);
+        new.message = sdsdup(message);
+        new.key = key ? sdsdup(key) : NULL;
+    }
+
+    pthread_mutex_lock(&server.history_lock);
+    if (seq == 0) {
+        atomicGetIncr(server.history_seq,last,1);
+        seq = last+1;
+    } else {
+        atomicGet(server.history_seq,last);
+        if (seq != last+1) historyClear();
+        atomicSet(server.history_seq,seq);
+    }
+    new.seq = seq;
+
+    if (server.history_size) {
+        he = server.history+(seq % server.history_size);
+        old = *he;
+        *he = new;
+        if (server.history_len < server.history_size) server.history_len++;
+    }
+    replicationFeedReplicas(&new);
+    pthread_mutex_unlock(&server.history_lock);
+    historyFreeEntry(&old);
+    return seq;
+}
+
+/* Send to 'c' the messages of 'channel' in the history with a sequence
+ * number greater than 'since'. Returns C_ERR if some of them are not in
+ * the history anymore, or 'since' is not a sequence number of ours. The
+ * caller must hold the lock of the channel shard. */
+static int historyReplay(client *c, sds channel, long long since) {
+    long long seq, oldest, last;
+    int retval = C_OK;
+
+    pthread_mutex_lock(&server.history_lock);
+    atomicGet(server.history_seq,last);
+    oldest = last-server.history_len+1;
+    if (since > last || since < oldest-1) {
+        retval = C_ERR;
+    } else {
+        for (seq = since+1; seq <= last; seq++) {
+            historyEntry *he = server.history+(seq % server.history_size);
+            sds msg, key;
+
+            if (sdscmp(he->channel,channel)) continue;
+            msg = pubsubMessageLine(channel,he->message,seq);
+            key = pubsubConflationKey(channel,he->key);
+            if (key)
+                addReplyConflated(c,key,msg,sdslen(msg));
+            else
+                addReplyString(c,msg,sdslen(msg));
+            sdsfree(msg);
+            sdsfree(key);
+        }
+    }
+    pthread_mutex_unlock(&server.history_lock);
+    return retval;
+}
+
+/*-----------------------------------------------------------------------------
+ * Pubsub commands implementation
+ *----------------------------------------------------------------------------*/
+
+/* Implements SUBSCRIBE and RESUME, 'argv' starts with the command name
+ * followed by the channel. */
+static void subscribeGenericCommand(client *c, sds *argv, int argc,
+                                    long long since)
+{
+    sds channel = argv[1], channel_data = NULL;
+    int presence = pubsubIsPresenceChannel(channel);
+    int auth = pubsubChannelRequiresAuth(channel);
+
+    if ((presence && (argc < 4 || argc > 5)) ||
+        (!presence && argc != (auth ? 3 : 2)))
+    {
+        addReplyErrorFormat(c,"wrong number of arguments for '%s' command",
+            c->argv[0]);
+        return;
+    }
+
+    if (presence) {
+        channel_data = sdsdup(argv[3]);
+        if (argc == 5) channel_data = sdscatfmt(channel_data,":%S",argv[4]);
+    }
+    if (auth && authVerifyChannel(c,channel,argv[2],channel_data) != C_OK) {
+        addReplyErrorFormat(c,"invalid auth signature for channel '%s'",
+            channel);
+        sdsfree(channel_data);
+        return;
+    }
+    sdsfree(channel_data);
+
+    if (presence)
+        pubsubSubscribeChannel(c,channel,argv[3],argc == 5 ? argv[4] : NULL,
+            since);
+    else
+        pubsubSubscribeChannel(c,channel,NULL,NULL,since);
+}
+
+/* SUBSCRIBE <channel> [<auth> [<user id> [<user info>]]]
+ *
+ * Private and presence channels require an auth signature (see auth.c).
+ * Presence channels also require the user id, that together with the
+ * optional user info makes the channel data: "<user id>[:<user info>]". */
+void subscribeCommand(client *c) {
+    subscribeGenericCommand(c,c->argv,c->argc,-1);
+}
+
+/* RESUME <sequence number> <channel> [<auth> [<user id> [<user info>]]]
+ *
+ * Like SUBSCRIBE, but the client also gets the messages it missed since
+ * the one with the given sequence number, as long as they are still in
+ * the history. */
+void resumeCommand(client *c) {
+    long long since;
+
+    if (!string2ll(c->argv[1],sdslen(c->argv[1]),&since) || since < 0) {
+        addReplyError(c,"invalid sequence number");
+        return;
+    }
+    subscribeGenericCommand(c,c->argv+1,c->argc-1,since);
+}
+
+/* UNSUBSCRIBE [channel [channel ...]] */
+void unsubscribeCommand(client *c) {
+    if (c->argc == 1) {
+        pubsubUnsubscribeAllChannels(c,1);
+    } else {
+        int j;
+
+        for (j = 1; j < c->argc; j++)
+            pubsubUnsubscribeChannel(c,c->argv[j],1);
+    }
+}
+
+/* Return true if 's' contains a CR or a LF. The cluster bus and the
+ * replication stream are made of lines, so a published message holding one
+ * could inject lines in them. */
+int pubsubHasLineBreak(sds s) {
+    return memchr(s,'\r',sdslen(s)) || memchr(s,'\n',sdslen(s));
+}
+
+/* PUBLISH <channel> <message> [<conflation key>]
+ *
+ * Messages published with a conflation key only need to reach the
+ * subscribers in their latest version: a subscriber that is behind gets
+ * just the newest message for every key it has pending.
+ *
+ * The reply is the number of subscribers on this node, the message is
+ * also forwarded to the cluster nodes having subscribers for the channel. */
 void publishCommand(client *c) {
-    int receivers = pubsubPublishMessage(c->argv[1],c->argv[2]);
+    int receivers;
+
+    if (c->argc > 4) {
+        addReplyErrorFormat(c,"wrong number of arguments for '%s' command",
+            "publish");
+        return;
+    }
+    if (pubsubHasLineBreak(c->argv[1]) || pubsubHasLineBreak(c->argv[2]) ||
+        (c->argc == 4 && pubsubHasLineBreak(c->argv[3])))
+    {
+        addReplyError(c,"ERR channel, message and key can't contain CR or LF");
+        return;
+    }
+    if (replicationIsReplica()) {
+        addReplyError(c,"READONLY You can't publish against a replica");
+        return;
+    }
+    if (evictMemoryIfNeeded(0) == C_ERR) {
+        addReplyError(c,"OOM command not allowed when used memory > "
+                        "'maxmemory'");
+        return;
+    }
+    receivers = pubsubPublishMessage(c->argv[1],c->argv[2],
+        c->argc == 4 ? c->argv[3] : NULL,0);
+    clusterPropagatePublish(c->argv[1],c->argv[2],
+        c->argc == 4 ? c->argv[3] : NULL);
     addReplyLongLong(c,receivers);
 }
@@ -0,0 +1,317 @@
+#include "server.h"
+#include "atomicvar.h"
+
+/*-----------------------------------------------------------------------------
+ * Replication
+ *
+ * A replica connects to its master like any client and sends it
+ * "SYNC <sequence number> <password>". The master answers "synced <sequence
+ * number>" and from then on streams to it every published message, starting
+ * from the ones after the given sequence number that are still in its
+ * history, one line per message:
+ *
+ *   pub <seq> <channel> <message> [<key>]
+ *
+ * Any other answer, like the error of a master refusing the SYNC, closes
+ * the link, and the replica tries again REPL_RECONNECT_PERIOD later.
+ *
+ * The stream is framed only by CRLF: PUBLISH refuses messages holding a CR
+ * or a LF, so a client can't inject lines, and the replica checks it again
+ * on the lines it gets, since it delivers them to its own clients.
+ *
+ * The replica delivers them to its own subscribers and keeps them in its
+ * history with the same sequence numbers, so that when the master fails
+ * the clients reconnecting to the replica can RESUME where they left.
+ * The stream goes through the client output buffers of the master, so
+ * many messages are sent with a single write.
+ *
+ * SYNC and REPLICAOF must give the replication-password of the instance,
+ * and are refused when it has none. The replica sends its own
+ * replication-password to its master, so every instance of a replication
+ * set shares the same one.
+ *----------------------------------------------------------------------------*/
+
+#define REPL_RECONNECT_PERIOD 1000 /* Milliseconds between connections */
+#define REPL_READ_LEN (16*1024)
+#define REPL_MAX_LINE_LEN (1024*1024) /* Drop masters sending longer lines */
+
+static void replicationReadHandler(aeEventLoop *el, int fd, void *privdata,
+                                   int mask);
+
+/* --------------------------- MASTER -------------------------------------- */
+
+/* Return the "pub" line of a message. */
+sds replicationPubLine(historyEntry *he) {
+    sds line = sdscatfmt(sdsempty(),"pub %I %S %S",he->seq,he->channel,
+        he->message);
+
+    if (he->key) line = sdscatfmt(line," %S",he->key);
+    return line;
+}
+
+/* Send a message to every replica. The caller must hold the history lock. */
+void replicationFeedReplicas(historyEntry *he) {
+    client *c;
+    sds line;
+
+    if (clientListLength(&server.replicas) == 0) return;
+
+    line = replicationPubLine(he);
+    for (c = clientListFirst(&server.replicas); c;
+         c = clientListNext(&server.replicas,c))
+        addReplyString(c,line,sdslen(line));
+    sdsfree(line);
+}
+
+/* Called when a replica client is freed. */
+void replicationUnlinkReplica(client *c) {
+    pthread_mutex_lock(&server.history_lock);
+    if (clientListContains(&server.replicas,c))
+        clientListDel(&server.replicas,c);
+    pthread_mutex_unlock(&server.history_lock);
+    serverLog(LL_NOTICE,"Replica %llu lost",(unsigned long long)c->id);
+}
+
+/* Reply with an error and return 0 unless 'password' is the
+ * replication-password. */
+static int replicationCheckPassword(client *c, sds password) {
+    if (server.repl_password == NULL) {
+        addReplyError(c,"replication disabled");
+        return 0;
+    }
+    if (!authCheckPassword(server.repl_password,password)) {
+        addReplyError(c,"invalid replication password");
+        return 0;
+    }
+    return 1;
+}
+
+/* SYNC <sequence number> <password>
+ *
+ * Turn the client into a replica. The messages following the given one
+ * that are still in the history are sent first, then the live stream. */
+void syncCommand(client *c) {
+    long long since, seq, oldest;
+
+    if (!replicationCheckPassword(c,c->argv[2])) return;
+    if (!string2ll(c->argv[1],sdslen(c->argv[1]),&since) || since < 0) {
+        addReplyError(c,"invalid sequence number");
+        return;
+    }
+
+    /* With all the shards locked no PUBLISH is halfway, and the ones
+     * that didn't see any replica before are all in the history. */
+    pubsubLockAllShards(1);
+    pthread_mutex_lock(&server.history_lock);
+    if (c->flags & CLIENT_REPLICA) {
+        pthread_mutex_unlock(&server.history_lock);
+        pubsubLockAllShards(0);
+        addReplyError(c,"already a replica");
+        return;
+    }
+    c->flags |= CLIENT_REPLICA;
+    clientListAddTail(&server.replicas,c);
+
+    /* A replica we have nothing in common with gets the whole history. */
+    oldest = server.history_seq-server.history_len+1;
+    if (since < oldest-1 || since > server.history_seq) since = oldest-1;
+    addReplySds(c,sdscatfmt(sdsempty(),"synced %I",since));
+    for (seq = since+1; seq <= server.history_seq; seq++) {
+        sds line = replicationPubLine(server.history+
+                                      (seq % server.history_size));
+
+        addReplySds(c,line);
+    }
+    pthread_mutex_unlock(&server.history_lock);
+    pubsubLockAllShards(0);
+    serverLog(LL_NOTICE,"Replica %llu synced from sequence number %lld",
+        (unsigned long long)c->id, since);
+}
+
+/* --------------------------- REPLICA ------------------------------------- */
+
+int replicationIsReplica(void) {
+    int replica;
+
+    pthread_mutex_lock(&server.repl_lock);
+    replica = server.masterhost != NULL;
+    pthread_mutex_unlock(&server.repl_lock);
+    return replica;
+}
+
+static void replicationCloseMaster(char *reason) {
+    atomicSet(server.repl_synced,0);
+    aeDeleteFileEvent(server.el,server.repl_fd,AE_READABLE|AE_WRITABLE);
+    close(server.repl_fd);
+    server.repl_fd = -1;
+    sdsfree(server.repl_rcvbuf);
+    server.repl_rcvbuf = NULL;
+    serverLog(LL_NOTICE,"Connection with master lost: %s",reason);
+}
+
+/* The connection with the master is established: ask for the messages
+ * following the latest one we have. */
+static void replicationSendSync(aeEventLoop *el, int fd, void *privdata,
+                                int mask)
+{
+    long long seq;
+    sds buf;
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    atomicGet(server.history_seq,seq);
+    buf = sdscatfmt(sdsempty(),"SYNC %I %s\r\n",seq,
+        server.repl_password ? server.repl_password : "");
+
+    aeDeleteFileEvent(server.el,fd,AE_WRITABLE);
+    if (write(fd,buf,sdslen(buf)) != (ssize_t)sdslen(buf)) {
+        sdsfree(buf);
+        replicationCloseMaster(strerror(errno));
+        return;
+    }
+    sdsfree(buf);
+    serverLog(LL_NOTICE,"Connected to master, SYNC %lld",seq);
+}
+
+/* Returns C_ERR if the line is not one the master sends to a replica it
+ * accepted: the link must then be closed. */
+static int replicationProcessLine(int argc, sds *argv) {
+    long long seq;
+    int synced;
+
+    atomicGet(server.repl_synced,synced);
+    if (synced && !strcmp(argv[0],"pub") && (argc == 4 || argc == 5) &&
+        string2ll(argv[1],sdslen(argv[1]),&seq) && seq > 0 &&
+        !pubsubHasLineBreak(argv[2]) && !pubsubHasLineBreak(argv[3]) &&
+        (argc == 4 || !pubsubHasLineBreak(argv[4])))
+    {
+        pubsubPublishMessage(argv[2],argv[3],argc == 5 ? argv[4] : NULL,seq);
+    } else if (!synced && !strcmp(argv[0],"synced") && argc == 2) {
+        atomicSet(server.repl_synced,1);
+        serverLog(LL_NOTICE,"Synced with master from sequence number %s",
+            argv[1]);
+    } else if (strcmp(argv[0],"connection_established")) {
+        return C_ERR;
+    }
+    return C_OK;
+}
+
+static void replicationReadHandler(aeEventLoop *el, int fd, void *privdata,
+                                   int mask)
+{
+    char buf[REPL_READ_LEN];
+    ssize_t nread;
+    char *newline;
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    nread = read(fd,buf,sizeof(buf));
+    if (nread == -1 && errno == EAGAIN) return;
+    if (nread <= 0) {
+        replicationCloseMaster(nread ? strerror(errno) : "connection closed");
+        return;
+    }
+    if (sdslen(server.repl_rcvbuf)+nread > REPL_MAX_LINE_LEN) {
+        replicationCloseMaster("line too long");
+        return;
+    }
+
+    /* Process every complete line, and keep the rest for the next read. */
+    server.repl_rcvbuf = sdscatlen(server.repl_rcvbuf,buf,nread);
+    while ((newline = strstr(server.repl_rcvbuf,"\r\n")) != NULL) {
+        size_t len = newline-server.repl_rcvbuf;
+        sds *argv;
+        int argc;
+
+        argv = sdssplitlen(server.repl_rcvbuf,len," ",1,&argc);
+        if (argc && replicationProcessLine(argc,argv) == C_ERR) {
+            sds reason = sdsnew("unexpected reply '");
+
+            reason = sdscatlen(reason,server.repl_rcvbuf,len);
+            reason = sdscatlen(reason,"'",1);
+            sdsfreesplitres(argv,argc);
+            replicationCloseMaster(reason);
+            sdsfree(reason);
+            return;
+        }
+        sdsfreesplitres(argv,argc);
+        sdsrange(server.repl_rcvbuf,len+2,-1);
+    }
+}
+
+/* Called from serverCron(): keep the replica connected to its master. */
+void replicationCron(void) {
+    char *host = NULL;
+    int port = 0, changed, fd;
+
+    pthread_mutex_lock(&server.repl_lock);
+    changed = server.repl_changed;
+    server.repl_changed = 0;
+    if (server.masterhost) {
+        host = zstrdup(server.masterhost);
+        port = server.masterport;
+    }
+    pthread_mutex_unlock(&server.repl_lock);
+
+    if (changed && server.repl_fd != -1)
+        replicationCloseMaster("master changed");
+    if (host == NULL || server.repl_fd != -1 ||
+        mstime()-server.repl_connect_time < REPL_RECONNECT_PERIOD) goto done;
+    server.repl_connect_time = mstime();
+
+    fd = anetTcpNonBlockConnect(server.neterr,host,port);
+    if (fd == -1) {
+        serverLog(LL_WARNING,"Unable to connect to master %s:%d: %s",
+            host, port, server.neterr);
+        goto done;
+    }
+    anetEnableTcpNoDelay(NULL,fd);
+    if (aeCreateFileEvent(server.el,fd,AE_READABLE,
+            replicationReadHandler,NULL) == AE_ERR ||
+        aeCreateFileEvent(server.el,fd,AE_WRITABLE,
+            replicationSendSync,NULL) == AE_ERR)
+    {
+        aeDeleteFileEvent(server.el,fd,AE_READABLE);
+        close(fd);
+        goto done;
+    }
+    server.repl_fd = fd;
+    server.repl_rcvbuf = sdsempty();
+    serverLog(LL_NOTICE,"Connecting to master %s:%d",host,port);
+
+done:
+    zfree(host);
+}
+
+/* REPLICAOF <host> <port> <password> | REPLICAOF NO ONE <password>
+ *
+ * The link with the master is changed by the next replicationCron(). A
+ * replica turned into a master keeps its history and goes on with the
+ * sequence numbers of its old master. */
+void replicaofCommand(client *c) {
+    long long port = 0;
+
+    if (!replicationCheckPassword(c,c->argv[3])) return;
+    if (strcasecmp(c->argv[1],"no") || strcasecmp(c->argv[2],"one")) {
+        if (!string2ll(c->argv[2],sdslen(c->argv[2]),&port) ||
+            port <= 0 || port > 65535)
+        {
+            addReplyError(c,"invalid master port");
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&server.repl_lock);
+    zfree(server.masterhost);
+    server.masterhost = port ? zstrdup(c->argv[1]) : NULL;
+    server.masterport = port;
+    server.repl_changed = 1;
+    pthread_mutex_unlock(&server.repl_lock);
+    if (port)
+        serverLog(LL_NOTICE,"Replica of %s:%lld",c->argv[1],port);
+    else
+        serverLog(LL_NOTICE,"Master mode enabled");
+    addReplySds(c,sdsnew("OK"));
+}
@@ -1,7 +1,9 @@
 #include "server.h"
+#include "cluster.h"
 #include "adlist.h"
 #include "atomicvar.h"
 #include "thread_pool.h"
+#include "slab.h"
 
 #include <time.h>
 #include <sys/time.h>
@@ -14,7 +16,14 @@
 struct server server; /* Server global state */
 
 struct pusherCommand pusherCommandTable[] = {
-    {"ping",pingCommand,0,0,0}
+    {"ping",pingCommand,0,CMD_INLINE,0,0},
+    {"subscribe",subscribeCommand,-2,CMD_INLINE|CMD_AUTH,0,0},
+    {"unsubscribe",unsubscribeCommand,-1,CMD_INLINE,0,0},
+    {"publish",publishCommand,-3,CMD_INLINE,0,0},
+    {"resume",resumeCommand,-3,0,0,0},
+    {"sync",syncCommand,3,0,0,0},
+    {"replicaof",replicaofCommand,4,0,0,0},
+    {"info",infoCommand,-1,0,0,0}
 };
 
 /* The PING command. It works in a different way if the client is in
@@ -49,18 +58,32 @@ long long ustime(void) {
 /* This is a hash table type that uses the SDS dynamic strings library as
  * keys. */
 
-uint64_t dictSdsCaseHash(const void *key) {
-    return dictGenCaseHashFunction((unsigned char*)key, sdslen((char*)key));
-}
-
-/* A case insensitive version used for the command lookup table and other
- * places where case insensitive non binary-safe comparison is needed. */
-int dictSdsKeyCaseCompare(void *privdata, const void *key1,
+int dictSdsKeyCompare(void *privdata, const void *key1,
         const void *key2)
 {
+    int l1,l2;
     DICT_NOTUSED(privdata);
 
-    return strcasecmp(key1, key2) == 0;
+    l1 = sdslen((sds)key1);
+    l2 = sdslen((sds)key2);
+    if (l1 != l2) return 0;
+    return memcmp(key1, key2, l1) == 0;
+}
+
+uint64_t dictSdsHash(const void *key) {
+    return dictGenHashFunction((unsigned char*)key, sdslen((char*)key));
+}
+
+/* Like dictSdsHash() but with the faster hash, that is not safe against
+ * hash flooding: only for keys that clients can't choose freely. */
+uint64_t dictSdsFastHash(const void *key) {
+    return dictGenFastHashFunction((unsigned char*)key, sdslen((char*)key));
+}
+
+/* Hash the pointer itself, for keys compared by address. Pointers are
+ * not chosen by clients, so the fast hash is enough. */
+uint64_t dictPtrHash(const void *key) {
+    return dictGenFastHashFunction(&key, sizeof(key));
 }
 
 void dictSdsDestructor(void *privdata, void *val)
@@ -70,16 +93,120 @@ void dictSdsDestructor(void *privdata, void *val)
     sdsfree(val);
 }
 
-/* Command table. sds string -> command struct pointer. */
-dictType commandTableDictType = {
-    dictSdsCaseHash,            /* hash function */
+void dictPubsubChannelDestructor(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    freePubsubChannel(val);
+}
+
+void dictPresenceMemberDestructor(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    freePresenceMember(val);
+}
+
+void dictPubsubSubscriptionDestructor(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    freePubsubSubscription(val);
+}
+
+void dictDictDestructor(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    dictRelease(val);
+}
+
+/* Channels dict. sds channel name -> pubsubChannel. The key is the name
+ * owned by the channel itself, so it is released with the value. */
+dictType pubsubChannelsDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    NULL,                       /* key destructor */
+    dictPubsubChannelDestructor /* val destructor */
+};
+
+/* Client subscriptions. sds channel name -> pubsubSubscription. */
+dictType clientPubsubChannelsDictType = {
+    dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
-    dictSdsKeyCaseCompare,      /* key compare */
+    dictSdsKeyCompare,          /* key compare */
     dictSdsDestructor,          /* key destructor */
+    dictPubsubSubscriptionDestructor /* val destructor */
+};
+
+/* Verified channel auths. sds "<socket id>" -> dict of the client, with
+ * authClientCacheDictType. */
+dictType authCacheDictType = {
+    dictSdsFastHash,            /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictDictDestructor          /* val destructor */
+};
+
+/* Verified channel auths of a client. sds channel -> sds auth. Only
+ * signatures that verified are added, so the keys are not free. */
+dictType authClientCacheDictType = {
+    dictSdsFastHash,            /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictSdsDestructor           /* val destructor */
+};
+
+/* Client conflated messages. sds key -> reply list node. */
+dictType clientConflatedDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    NULL                        /* val destructor */
+};
+
+/* Reverse of clientConflatedDictType. reply list node -> sds key, owned by
+ * the conflated dict. */
+dictType clientConflatedNodesDictType = {
+    dictPtrHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    NULL,                       /* key compare */
+    NULL,                       /* key destructor */
+    NULL                        /* val destructor */
+};
+
+/* Cluster nodes. sds name -> clusterNode, the name is owned by the node.
+ * The nodes come from the configuration. */
+dictType clusterNodesDictType = {
+    dictSdsFastHash,            /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    NULL,                       /* key destructor */
     NULL                        /* val destructor */
 };
 
+/* Presence channel members. sds user id -> presenceMember. The user ids
+ * come with the channel data signed by the app. */
+dictType presenceMembersDictType = {
+    dictSdsFastHash,            /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictPresenceMemberDestructor /* val destructor */
+};
+
 /* Return the UNIX time in milliseconds */
 mstime_t mstime(void) {
     return ustime()/1000;
@@ -149,10 +276,10 @@ void serverLogFromHandler(int level, const char *msg) {
 
     fd = STDOUT_FILENO;
     if (fd == -1) return;
-    // ll2string(buf,sizeof(buf),getpid());
+    ll2string(buf,sizeof(buf),getpid());
     if (write(fd,buf,strlen(buf)) == -1) goto err;
     if (write(fd,":signal-handler (",17) == -1) goto err;
-    // ll2string(buf,sizeof(buf),time(NULL));
+    ll2string(buf,sizeof(buf),time(NULL));
     if (write(fd,buf,strlen(buf)) == -1) goto err;
     if (write(fd,") ",2) == -1) goto err;
     if (write(fd,msg,strlen(msg)) == -1) goto err;
@@ -161,8 +288,64 @@ err:
     return;
 }
 
+/*-----------------------------------------------------------------------------
+ * Command table
+ *
+ * The command set is fixed, so instead of a dict the commands go in a
+ * small array indexed by a perfect hash of the whole name, taken as two
+ * words padded with spaces and with the case folded by setting the 0x20 bit
+ * of every byte: since the names are made of lowercase letters only, no
+ * other byte can match. The multiplier making the hash perfect is found
+ * once at startup, so adding a command needs nothing else. A lookup is
+ * then two multiplies, a shift and the compare of the two words.
+ *----------------------------------------------------------------------------*/
+
+#define COMMAND_TABLE_BITS 5
+#define COMMAND_TABLE_SIZE (1<<COMMAND_TABLE_BITS)
+#define COMMAND_NAME_MAX 16
+#define COMMAND_CASE_FOLD 0x2020202020202020ULL
+#define COMMAND_SEED_TRIES (1<<16) /* Multipliers tried before giving up */
+
+typedef struct commandSlot {
+    uint64_t name[COMMAND_NAME_MAX/8]; /* Lowercase name padded with spaces */
+    size_t len;
+    struct pusherCommand *cmd;
+} commandSlot;
+
+static commandSlot command_slots[COMMAND_TABLE_SIZE];
+static uint64_t command_seed;
+
+/* Hash a name folded with commandFoldName(). */
+static inline unsigned int commandHash(const uint64_t *folded, uint64_t seed) {
+    uint64_t h = folded[0]*seed;
+
+    h = ((h ^ (h >> 29))+folded[1])*seed;
+    return h >> (64-COMMAND_TABLE_BITS);
+}
+
+/* Copy a name in words padded with spaces and with the case folded. */
+static inline void commandFoldName(uint64_t *dst, const char *name,
+                                   size_t len)
+{
+    int j;
+
+    memset(dst,0,COMMAND_NAME_MAX);
+    memcpy(dst,name,len);
+    for (j = 0; j < COMMAND_NAME_MAX/8; j++) dst[j] |= COMMAND_CASE_FOLD;
+}
+
 struct pusherCommand *lookupCommand(sds name) {
-    return dictFetchValue(server.commands, name);
+    size_t len = sdslen(name);
+    uint64_t folded[COMMAND_NAME_MAX/8];
+    commandSlot *slot;
+
+    if (len == 0 || len > COMMAND_NAME_MAX) return NULL;
+    commandFoldName(folded,name,len);
+    slot = command_slots+commandHash(folded,command_seed);
+    if (slot->len != len) return NULL;
+    if (folded[0] != slot->name[0] || folded[1] != slot->name[1])
+        return NULL;
+    return slot->cmd;
 }
 
 /* We take a cached value of the unix time in the global state because with
@@ -175,48 +358,54 @@ void updateCachedTime(void) {
     server.mstime = mstime();
 }
 
-/* Check for timeouts. Returns non-zero if the client was terminated.
- * The function gets the current time in milliseconds as argument since
- * it gets called multiple times in a loop, so calling gettimeofday() for
- * each iteration would be costly without any actual gain. */
-int clientsCronHandleTimeout(client *c, mstime_t now_ms) {
-    time_t now = now_ms / 1000;
-
-    if (server.maxidletime + c->lastinteraction < now) {
-        serverLog(LL_VERBOSE, "Closing idle client");
-        freeClient(c);
-        return 1;
-    }
-    return 0;
+/* Return true if work is piling up besides the one of the cron itself:
+ * objects waiting for the lazyfree thread, commands waiting for room in the
+ * thread pool, or history messages evicted since the previous call. */
+static int serverHasBacklog(void) {
+    static long long last_evicted = 0;
+    long long pending, queued, evicted;
+
+    atomicGet(server.lazyfree_pending_objects,pending);
+    atomicGet(server.tpool->queued,queued);
+    pthread_mutex_lock(&server.history_lock);
+    evicted = server.stat_evicted_messages-last_evicted;
+    last_evicted = server.stat_evicted_messages;
+    pthread_mutex_unlock(&server.history_lock);
+
+    return pending || evicted || queued > CONFIG_DEFAULT_TASKS_LOW_WATER ||
+           clientListLength(&server.clients_waiting_pool);
 }
 
-#define CLIENTS_CRON_MIN_ITERATIONS 5
-void clientsCron(void) {
-    /* Make sure to process at least numclients/server.hz of clients
-     * per call. Since this function is called server.hz times per second
-     * we are sure that in the worst case we process all the clients in 1
-     * second. */
-    int numclients = listLength(server.clients);
-    int iterations = numclients/server.hz;
-    mstime_t now = mstime();
+/* Choose the frequency of the next serverCron() calls. With nothing to do
+ * it drops to CONFIG_MIN_HZ, so that an idle server barely wakes up. With
+ * a defrag pass, evictions or a backlog going on, it rises over the
+ * configured hz, so that the bounded work every call does is spread in
+ * smaller slices, but no more than the measured duration of the cron
+ * allows without going over CRON_MAX_US_PER_SEC. The number of clients
+ * doesn't matter: their timeouts are in a timing wheel, whose cost only
+ * depends on the clients actually timing out. */
+static void serverUpdateHz(long long cron_us, int busy) {
+    unsigned long clients = clientListLength(&server.clients);
+    int hz = server.config_hz, maxhz;
+
+    server.cron_avg_us = (server.cron_avg_us*7+cron_us)/8;
+    if (!server.dynamic_hz) {
+        server.hz = hz;
+        return;
+    }
 
-    if (iterations < CLIENTS_CRON_MIN_ITERATIONS)
-        iterations = (numclients < CLIENTS_CRON_MIN_ITERATIONS) ? 
-                     numclients : CLIENTS_CRON_MIN_ITERATIONS;
-    
-    while (listLength(server.clients) && iterations--) {
-        client *c;
-        listNode *head;
-
-        /* Rotate the list, take the current head, process.
-         * This way if the client must be removed from the list it's the
-         * first element and we don't incur into O(N) computation. */
-        listRotate(server.clients);
-        head = listFirst(server.clients);
-        c = listNodeValue(head);
-
-        if (clientsCronHandleTimeout(c, now)) continue;
+    if (clients == 0 && !busy) {
+        server.hz = CONFIG_MIN_HZ;
+        return;
     }
+    if (busy) hz *= 4;
+
+    maxhz = server.cron_avg_us ?
+            CRON_MAX_US_PER_SEC/server.cron_avg_us : CONFIG_MAX_HZ;
+    if (hz > maxhz) hz = maxhz;
+    if (hz < server.config_hz) hz = server.config_hz;
+    if (hz > CONFIG_MAX_HZ) hz = CONFIG_MAX_HZ;
+    server.hz = hz;
 }
 
 /* This is our timer interrupt, called server.hz times per second.
@@ -238,6 +427,8 @@ void clientsCron(void) {
  * a macro is used: run_with_period(milliseconds) { .... }
  */
 int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
+    long long start = ustime();
+    int busy;
     UNUSED(eventLoop);
     UNUSED(id);
     UNUSED(clientData);
@@ -248,13 +439,28 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     run_with_period(5000) {
         serverLog(LL_VERBOSE,
             "%lu clients connected, %zu bytes in use",
-            listLength(server.clients),
+            clientListLength(&server.clients),
             zmalloc_used_memory());
     }
 
-    /* We need to do a few operations on clients asynchronously. */
-    clientsCron();
+    /* Close the idle clients. */
+    clientsTimeoutCron();
+
+    /* Keep the cluster links connected. */
+    clusterCron();
+
+    /* Keep replicas connected to their master. */
+    replicationCron();
 
+    /* Get back under maxmemory, closing slow clients if needed. */
+    busy = evictMemoryIfNeeded(1) == C_ERR;
+
+    /* Move objects out of sparse pages when fragmentation is high. */
+    activeDefragCycle();
+    busy |= server.active_defrag_running;
+    busy |= serverHasBacklog();
+
+    serverUpdateHz(ustime()-start,busy);
     server.cronloops++;
     return 1000/server.hz;
 }
@@ -265,15 +471,30 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 void beforeSleep(struct aeEventLoop *eventLoop) {
     UNUSED(eventLoop);
 
+    /* Hand the commands waiting for room to the thread pool. */
+    postWaitingCommands();
+
     /* Handle writes with pending output buffers. */
     handleClientsWithPendingWrites();
+
+    /* Send the messages queued for the other cluster nodes. */
+    clusterBeforeSleep();
+
+    /* Close clients that need to be closed asynchronous, now that no lock
+     * is held anymore. */
+    freeClientsInAsyncFreeQueue();
 }
 
 void initServerConfig(void) {
     pthread_mutex_init(&server.next_client_id_mutex, NULL);
     pthread_mutex_init(&server.lock, NULL);
+    pthread_mutex_init(&server.auth_lock, NULL);
+    pthread_mutex_init(&server.history_lock, NULL);
+    pthread_mutex_init(&server.repl_lock, NULL);
 
-    server.hz = CONFIG_DEFAULT_HZ;
+    server.hz = server.config_hz = CONFIG_DEFAULT_HZ;
+    server.dynamic_hz = CONFIG_DEFAULT_DYNAMIC_HZ;
+    server.cron_avg_us = 0;
     server.port = CONFIG_DEFAULT_SERVER_PORT;
     server.tcp_backlog = CONFIG_DEFAULT_TCP_BACKLOG;
     server.bindaddr_count = 0;
@@ -282,7 +503,47 @@ void initServerConfig(void) {
     server.tcpkeepalive = CONFIG_DEFAULT_TCP_KEEPALIVE;
     server.maxclients = CONFIG_DEFAULT_MAX_CLIENTS;
     server.maxmemory = CONFIG_DEFAULT_MAXMEMORY;
-    server.commands = dictCreate(&commandTableDictType,NULL);
+    server.maxmemory_policy = CONFIG_DEFAULT_MAXMEMORY_POLICY;
+    server.app_key = NULL;
+    server.server_cpulist = NULL;
+    server.worker_cpulist = NULL;
+    server.lazyfree_cpulist = NULL;
+    server.app_secret = NULL;
+    server.auth_cache_size = CONFIG_DEFAULT_AUTH_CACHE_SIZE;
+    server.flush_delay = CONFIG_DEFAULT_FLUSH_DELAY;
+    server.flush_timer_id = -1;
+    server.pubsub_shards_count = CONFIG_DEFAULT_PUBSUB_SHARDS;
+    server.cluster_enabled = 0;
+    server.cluster_port = 0;
+    server.cluster_announce_ip = zstrdup(CONFIG_DEFAULT_CLUSTER_ANNOUNCE_IP);
+    server.cluster_config_nodes = listCreate();
+    server.history_size = CONFIG_DEFAULT_HISTORY_SIZE;
+    clientListInit(&server.replicas,CLIENT_LIST_REPLICAS);
+    server.masterhost = NULL;
+    server.masterport = 0;
+    server.repl_password = NULL;
+    server.repl_changed = 0;
+    server.repl_fd = -1;
+    server.repl_rcvbuf = NULL;
+    server.repl_synced = 0;
+    server.repl_connect_time = 0;
+    server.cluster_bloom_bits = CONFIG_DEFAULT_CLUSTER_BLOOM_BITS;
+    server.cluster_bloom_hashes = CONFIG_DEFAULT_CLUSTER_BLOOM_HASHES;
+    server.cluster = NULL;
+    server.cfd_count = 0;
+    server.handoff_socket = NULL;
+    server.handoff_fd = -1;
+    server.active_defrag_enabled = CONFIG_DEFAULT_ACTIVE_DEFRAG;
+    server.active_defrag_threshold = CONFIG_DEFAULT_DEFRAG_THRESHOLD;
+    server.active_defrag_ignore_bytes = CONFIG_DEFAULT_DEFRAG_IGNORE_BYTES;
+    server.active_defrag_cycle = CONFIG_DEFAULT_DEFRAG_CYCLE;
+    server.active_defrag_running = 0;
+    server.lazyfree_threshold = CONFIG_DEFAULT_LAZYFREE_THRESHOLD;
+    server.busy_poll = CONFIG_DEFAULT_BUSY_POLL;
+    server.busy_poll_sockets = CONFIG_DEFAULT_BUSY_POLL_SOCKETS;
+    server.worker_busy_poll = CONFIG_DEFAULT_WORKER_BUSY_POLL;
+    server.inline_commands = CONFIG_DEFAULT_INLINE_COMMANDS;
+    server.lazyfree_pending_objects = 0;
     populateCommandTable();
 }
 
@@ -339,7 +600,7 @@ static void acceptCommonHandler(int fd, int flags, char *ip) {
      * connection. Note that we create the client instead to check before
      * for this condition, since now the socket is already set in non-blocking
      * mode and we can send an error for free using the Kernel I/O */
-    if (listLength(server.clients) > server.maxclients) {
+    if (clientListLength(&server.clients) > server.maxclients) {
         char *err = "-ERR max number of clients reached\r\n";
 
         /* That's a best effort error message, don't check write errors */
@@ -350,6 +611,11 @@ static void acceptCommonHandler(int fd, int flags, char *ip) {
         freeClient(c);
         return;
     }
+
+    /* Tell the client its socket id, that private and presence channels
+     * auth signatures are bound to. */
+    addReplySds(c,sdscatfmt(sdsempty(),"connection_established %U",
+        (unsigned long long)c->id));
 }
 
 #define MAX_ACCEPTS_PER_CALL 1000
@@ -440,8 +706,18 @@ void initServer(void) {
     setupSignalHandlers();
 
     server.pid = getpid();
-    server.clients = listCreate();
-    server.clients_pending_write = listCreate();
+    server.hz = server.config_hz;
+    updateCachedTime();
+    clientListInit(&server.clients,CLIENT_LIST_ALL);
+    clientListInit(&server.clients_pending_write,CLIENT_LIST_PENDING_WRITE);
+    clientListInit(&server.clients_to_close,CLIENT_LIST_TO_CLOSE);
+    clientListInit(&server.clients_tasks_done,CLIENT_LIST_TASKS_DONE);
+    clientListInit(&server.clients_waiting_pool,CLIENT_LIST_WAITING_POOL);
+    clientsTimeoutInit();
+    pubsubInitShards();
+    historyInit();
+    server.auth_cache = dictCreate(&authCacheDictType,NULL);
+    server.auth_cache_len = 0;
     server.system_memory_size = zmalloc_get_memory_size();
     server.el = aeCreateEventLoop(server.maxclients+CONFIG_FDSET_INCR);
     if (server.el == NULL) {
@@ -450,9 +726,13 @@ void initServer(void) {
             strerror(errno));
         exit(1);
     }
+    aeSetBusyPoll(server.el,server.busy_poll);
+
+    /* Take over the sockets of the instance we are replacing, if any. */
+    handoffReceive();
 
     /* Open the TCP listening socket for the user commands. */
-    if (server.port != 0 &&
+    if (server.port != 0 && server.ipfd_count == 0 &&
         listenToPort(server.port,server.ipfd,&server.ipfd_count) == C_ERR)
         exit(1);
 
@@ -464,6 +744,12 @@ void initServer(void) {
 
     server.cronloops = 0;
 
+    /* Connect to the other nodes of the cluster, if any. */
+    clusterInit();
+
+    /* Serve again the clients handed off by the old instance. */
+    handoffRestoreClients();
+
     /* Create the timer callback, this is our way to process many background
      * operations incrementally, like clients timeout, eviction of unaccessed
      * expired keys and so forth. */
@@ -483,28 +769,273 @@ void initServer(void) {
             }
     }
     
+    handoffInit();
+
     server.initial_memory_usage = zmalloc_used_memory();
 
-    server.tpool = thread_pool_create("pusher-server", CONFIG_DEFAULT_THREADS, CONFIG_DEFAULT_MAX_TASKS);
+    server.tpool = thread_pool_create("pusher-server", CONFIG_DEFAULT_THREADS,
+        CONFIG_DEFAULT_MAX_TASKS, server.worker_cpulist);
+    thread_pool_set_spin(server.tpool,server.worker_busy_poll);
+    tasksDoneInit();
+    lazyfreeInit();
+
+    /* Only pin the main thread now, so that the threads created above don't
+     * inherit its CPUs. */
+    server.main_thread = pthread_self();
+    setcpuaffinity("main",server.server_cpulist);
 }
 
 /* Populates the Pusher Command Table starting from the hard coded list
- * we have on top of server.c file. */
+ * we have on top of server.c file, looking for a multiplier that gives
+ * every command its own slot. */
 void populateCommandTable(void) {
     int j;
     int numcommands = sizeof(pusherCommandTable)/sizeof(struct pusherCommand);
+    struct pusherCommand *collision[2] = {NULL,NULL};
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    long tries;
 
     for (j = 0; j < numcommands; j++) {
-        struct pusherCommand *c = pusherCommandTable+j;
-        dictAdd(server.commands, sdsnew(c->name), c);
+        const char *p;
+        size_t len = strlen(pusherCommandTable[j].name);
+
+        serverAssert(len > 0 && len <= COMMAND_NAME_MAX);
+        for (p = pusherCommandTable[j].name; *p; p++)
+            serverAssert(*p >= 'a' && *p <= 'z');
     }
+
+    for (tries = 0; tries < COMMAND_SEED_TRIES; tries++, seed += 2) {
+        memset(command_slots,0,sizeof(command_slots));
+        for (j = 0; j < numcommands; j++) {
+            struct pusherCommand *c = pusherCommandTable+j;
+            size_t len = strlen(c->name);
+            uint64_t folded[COMMAND_NAME_MAX/8];
+            commandSlot *slot;
+
+            commandFoldName(folded,c->name,len);
+            slot = command_slots+commandHash(folded,seed);
+            if (slot->cmd) {
+                collision[0] = slot->cmd;
+                collision[1] = c;
+                break;
+            }
+            memcpy(slot->name,folded,sizeof(folded));
+            slot->len = len;
+            slot->cmd = c;
+        }
+        if (j == numcommands) {
+            command_seed = seed;
+            return;
+        }
+    }
+    serverPanic("No perfect hash for the command table after %d multipliers, "
+                "the last one tried puts '%s' and '%s' in the same slot: "
+                "raise COMMAND_TABLE_BITS", COMMAND_SEED_TRIES,
+                collision[0]->name, collision[1]->name);
+}
+
+/* Create the string returned by the INFO command. 'section' is the
+ * section to report, or "all". */
+sds genPusherInfoString(char *section) {
+    sds info = sdsempty();
+    int allsections = !strcasecmp(section,"all");
+    int sections = 0;
+
+    /* Memory */
+    if (allsections || !strcasecmp(section,"memory")) {
+        size_t zmalloc_used = zmalloc_used_memory();
+        size_t rss = zmalloc_get_rss();
+        size_t allocated, active, resident;
+        long long pending;
+
+        zmalloc_get_allocator_info(&allocated,&active,&resident);
+        atomicGet(server.lazyfree_pending_objects,pending);
+        if (sections++) info = sdscat(info,"\r\n\r\n");
+        info = sdscatprintf(info,
+            "# Memory\r\n"
+            "used_memory:%zu\r\n"
+            "used_memory_rss:%zu\r\n"
+            "used_memory_startup:%zu\r\n"
+            "allocator_allocated:%zu\r\n"
+            "allocator_active:%zu\r\n"
+            "allocator_resident:%zu\r\n"
+            "allocator_frag_ratio:%.2f\r\n"
+            "allocator_rss_ratio:%.2f\r\n"
+            "mem_fragmentation_ratio:%.2f\r\n"
+            "total_system_memory:%zu\r\n"
+            "slab_free_memory:%zu\r\n"
+            "maxmemory_used_memory:%zu\r\n"
+            "maxmemory:%llu\r\n"
+            "maxmemory_policy:%s\r\n"
+            "mem_allocator:%s\r\n"
+            "active_defrag_running:%d\r\n"
+            "active_defrag_hits:%lld\r\n"
+            "active_defrag_misses:%lld\r\n"
+            "lazyfree_pending_objects:%lld",
+            zmalloc_used,
+            rss,
+            server.initial_memory_usage,
+            allocated,
+            active,
+            resident,
+            allocated ? (float)active/allocated : 0,
+            active ? (float)resident/active : 0,
+            zmalloc_used ? (float)rss/zmalloc_used : 0,
+            server.system_memory_size,
+            slabFreeMemory(),
+            evictUsedMemory(),
+            server.maxmemory,
+            maxmemoryPolicyName(server.maxmemory_policy),
+            ZMALLOC_LIB,
+            server.active_defrag_running,
+            server.stat_active_defrag_hits,
+            server.stat_active_defrag_misses,
+            pending);
+    }
+
+    /* Stats */
+    if (allsections || !strcasecmp(section,"stats")) {
+        long long lazyfreed;
+
+        atomicGet(server.stat_lazyfreed_objects,lazyfreed);
+        if (sections++) info = sdscat(info,"\r\n\r\n");
+        info = sdscatprintf(info,
+            "# Stats\r\n"
+            "rejected_connections:%lld\r\n"
+            "conflated_messages:%lld\r\n"
+            "evicted_messages:%lld\r\n"
+            "evicted_clients:%lld\r\n"
+            "oom_rejected_publishes:%lld\r\n"
+            "lazyfreed_objects:%lld\r\n"
+            "hz:%d\r\n"
+            "configured_hz:%d\r\n"
+            "cron_avg_us:%lld\r\n"
+            "busy_poll_hits:%lld\r\n"
+            "busy_poll_parks:%lld\r\n"
+            "worker_spin_hits:%lld\r\n"
+            "worker_parks:%lld\r\n"
+            "inline_commands:%lld\r\n"
+            "offloaded_commands:%lld\r\n"
+            "client_reads_paused:%lu\r\n"
+            "client_reads_pauses:%lld\r\n"
+            "client_reads_paused_us:%lld",
+            server.stat_rejected_conn,
+            server.stat_conflated_messages,
+            server.stat_evicted_messages,
+            server.stat_evicted_clients,
+            server.stat_oom_rejected_publishes,
+            lazyfreed,
+            server.hz,
+            server.config_hz,
+            server.cron_avg_us,
+            server.el->busypoll_hits,
+            server.el->busypoll_parks,
+            server.tpool->spin_hits,
+            server.tpool->parks,
+            server.stat_inline_commands,
+            server.stat_offloaded_commands,
+            clientListLength(&server.clients_waiting_pool),
+            server.stat_reads_pauses,
+            server.stat_reads_paused_us);
+    }
+
+    /* Replication */
+    if (allsections || !strcasecmp(section,"replication")) {
+        unsigned long replicas;
+        int synced;
+
+        pthread_mutex_lock(&server.history_lock);
+        replicas = clientListLength(&server.replicas);
+        pthread_mutex_unlock(&server.history_lock);
+        atomicGet(server.repl_synced,synced);
+        if (sections++) info = sdscat(info,"\r\n\r\n");
+        pthread_mutex_lock(&server.repl_lock);
+        if (server.masterhost) {
+            info = sdscatprintf(info,
+                "# Replication\r\n"
+                "role:replica\r\n"
+                "master_host:%s\r\n"
+                "master_port:%d\r\n"
+                "master_link_status:%s\r\n",
+                server.masterhost,
+                server.masterport,
+                synced ? "up" : "down");
+        } else {
+            info = sdscat(info,"# Replication\r\nrole:master\r\n");
+        }
+        pthread_mutex_unlock(&server.repl_lock);
+        info = sdscatprintf(info,"connected_replicas:%lu",replicas);
+    }
+
+    /* CPU */
+    if (allsections || !strcasecmp(section,"cpu")) {
+        int j;
+
+        if (sections++) info = sdscat(info,"\r\n\r\n");
+        info = sdscatprintf(info,"# CPU\r\nnuma_nodes:%d\r\nmain_cpus:",
+            numaNodesCount());
+        info = catcpuaffinity(info,server.main_thread);
+        for (j = 0; j < server.tpool->thread_count; j++) {
+            info = sdscatfmt(info,"\r\nworker%i_cpus:",j);
+            info = catcpuaffinity(info,server.tpool->threads[j]);
+        }
+        info = sdscat(info,"\r\nlazyfree_cpus:");
+        info = catcpuaffinity(info,server.lazyfree_pool->threads[0]);
+    }
+    return info;
+}
+
+/* INFO [section] */
+void infoCommand(client *c) {
+    char *section = c->argc == 2 ? c->argv[1] : "all";
+
+    if (c->argc > 2) {
+        addReplyErrorFormat(c,"wrong number of arguments for '%s' command",
+            "info");
+        return;
+    }
+    addReplySds(c,genPusherInfoString(section));
 }
 
 int main(int argc, char **argv) {
-    struct timeval tv;
-    int i;
+    uint8_t hashseed[16];
 
+    getRandomBytes(hashseed,sizeof(hashseed));
+    dictSetHashFunctionSeed(hashseed);
     initServerConfig();
+
+    if (argc >= 2) {
+        int j = 1; /* First option to parse in argv[] */
+        sds options = sdsempty();
+        char *configfile = NULL;
+
+        /* First argument is the config file name? */
+        if (argv[j][0] != '-' || argv[j][1] != '-') {
+            configfile = argv[j];
+            j++;
+        }
+
+        /* All the other options are parsed and conceptually appended to the
+         * configuration file. For instance --port 6380 will generate the
+         * string "port 6380\n" to be parsed after the actual file name
+         * is parsed, if any. */
+        while(j != argc) {
+            if (argv[j][0] == '-' && argv[j][1] == '-') {
+                /* Option name */
+                if (sdslen(options)) options = sdscat(options,"\n");
+                options = sdscat(options,argv[j]+2);
+                options = sdscat(options," ");
+            } else {
+                /* Option argument */
+                options = sdscatrepr(options,argv[j],strlen(argv[j]));
+                options = sdscat(options," ");
+            }
+            j++;
+        }
+        loadServerConfig(configfile,options);
+        sdsfree(options);
+    }
+
     initServer();
     aeSetBeforeSleepProc(server.el,beforeSleep);
     aeMain(server.el);
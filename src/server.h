@@ -24,6 +24,7 @@
 #include "thread_pool.h"
 
 #define PROTO_BUFFER_BYTES (16*1024)
+#define PROTO_REPLY_CHUNK_BYTES (16*1024) /* Max size of coalesced replies */
 
 /* Log levels */
 #define LL_DEBUG 0
@@ -43,6 +44,15 @@
 /* Client flags */
 #define CLIENT_PENDING_WRITE (1<<0) /* Client has output to send but a write
                                        handler is yet not installed. */
+#define CLIENT_CLOSE_ASAP (1<<1)    /* Close this client ASAP */
+#define CLIENT_REPLICA (1<<2)       /* Replica fed with the published messages */
+
+/* Presence channels are the ones starting with this prefix. */
+#define PRESENCE_CHANNEL_PREFIX "presence-"
+#define PRESENCE_CHANNEL_PREFIX_LEN 9
+/* Private channels, like presence ones, require an auth signature. */
+#define PRIVATE_CHANNEL_PREFIX "private-"
+#define PRIVATE_CHANNEL_PREFIX_LEN 8
 
 /* We can print the stacktrace, so our assert is defined this way: */
 #define serverAssert(_e) ((_e)?(void)0 : (_serverAssert(#_e,__FILE__,__LINE__),_exit(1)))
@@ -56,42 +66,151 @@
 
 typedef long long mstime_t; /* millisecond time type. */
 
+/* Server side lists of clients. The links are embedded in the client, one
+ * pair for each list, so that linking and unlinking are O(1) and don't
+ * allocate. */
+#define CLIENT_LIST_ALL 0           /* server.clients */
+#define CLIENT_LIST_PENDING_WRITE 1 /* server.clients_pending_write */
+#define CLIENT_LIST_TO_CLOSE 2      /* server.clients_to_close */
+#define CLIENT_LIST_REPLICAS 3      /* server.replicas */
+#define CLIENT_LIST_TIMEOUT 4       /* A bucket of server.timeout_wheel */
+#define CLIENT_LIST_TASKS_DONE 5    /* server.clients_tasks_done */
+#define CLIENT_LIST_WAITING_POOL 6  /* server.clients_waiting_pool */
+#define CLIENT_LISTS 7
+
+#define CLIENT_TIMEOUT_WHEEL_SIZE 256 /* Seconds, must be a power of two */
+
+typedef struct clientLink {
+    struct client *prev, *next;
+} clientLink;
+
+typedef struct clientList {
+    struct client *head, *tail;
+    unsigned long len;
+    int id;                 /* CLIENT_LIST_*, the links used in the clients */
+} clientList;
+
+#define clientListLength(l) ((l)->len)
+#define clientListFirst(l) ((l)->head)
+#define clientListNext(l,c) ((c)->links[(l)->id].next)
+
 /* With multiplexing we need to take per-client state.
  * Clients are taken in a linked list. */
 typedef struct client {
     uint64_t id;
     int fd;
     int argc;               /* Num of arguments of current command. */
-    sds **argv;            /* Arguments of current command. */
+    sds *argv;              /* Arguments of current command. */
     list *reply;
     unsigned long long reply_bytes;
+    dict *conflated;        /* Conflation key -> node of 'reply' holding
+                               the pending message with that key */
+    dict *conflated_nodes;  /* Node of 'reply' -> its key in 'conflated' */
     size_t sentlen;
     time_t ctime;
     time_t lastinteraction;
+    time_t timeout_at;      /* Timeout wheel bucket second, 0 if none */
+    long long pending_write_since; /* When (us) output started to pend. */
     int flags;
-    listNode *client_list_node;
+    int inflight;           /* Commands posted to the thread pool and not
+                               done yet. Protected by server.lock */
+    struct pusherCommand *waiting_cmd; /* Command waiting for room in the
+                                          thread pool, counted in inflight */
+    long long waiting_since; /* ustime() waiting_cmd started to wait */
+    clientLink links[CLIENT_LISTS]; /* Links in the server client lists */
+    dict *pubsub_channels;  /* channels a client is interested in (SUBSCRIBE) */
 
     /* Response buffer */
     int bufpos;
     char buf[PROTO_BUFFER_BYTES];
 
-    pthread_mutex_t lock;
+    pthread_mutex_t lock;   /* Protects pubsub_channels */
 } client;
 
+/* A member of a presence channel. The same user may be subscribed from
+ * more than one connection at the same time: refcount tracks how many, so
+ * that member_added and member_removed are only emitted when the user
+ * actually joins or leaves the channel. */
+typedef struct presenceMember {
+    sds info;               /* User info given by the first connection. */
+    unsigned long refcount; /* Connections of this user in the channel. */
+} presenceMember;
+
+typedef struct pubsubChannel {
+    sds name;
+    list *clients;          /* Subscribed clients. */
+    dict *members;          /* user id -> presenceMember. Presence only. */
+    sds members_cache;      /* Encoded member list sent on subscribe, or
+                               NULL if it has to be rebuilt. */
+} pubsubChannel;
+
+/* What a client remembers about each of its subscriptions, so that leaving
+ * a channel does not require any search. */
+typedef struct pubsubSubscription {
+    listNode *node;         /* The client node in channel->clients. */
+    sds user_id;            /* Presence user id, NULL for other channels. */
+} pubsubSubscription;
+
+/* The channels registry is split in shards, each with its own lock, so
+ * that commands on different channels run in parallel in the thread pool
+ * and only the ones on the same shard serialize. */
+typedef struct pubsubShard {
+    pthread_mutex_t lock;
+    dict *channels;         /* Map channels to pubsubChannel structs */
+} pubsubShard;
+
+/* A published message, as kept in the history and sent to the replicas. */
+typedef struct historyEntry {
+    long long seq;          /* Sequence number of the message. */
+    sds channel;
+    sds message;
+    sds key;                /* Conflation key, or NULL. */
+} historyEntry;
+
+/* Maxmemory policies, what is freed before refusing publishes */
+#define MAXMEMORY_NO_EVICTION 0     /* Nothing */
+#define MAXMEMORY_HISTORY 1         /* The oldest history messages */
+#define MAXMEMORY_HISTORY_CLIENTS 2 /* Then the slowest clients */
+
 /* Static server configuration */
 #define CONFIG_DEFAULT_HZ        10      /* Time interrupt calls/sec. */
+#define CONFIG_MIN_HZ            1
+#define CONFIG_MAX_HZ            500
+#define CONFIG_DEFAULT_DYNAMIC_HZ 1
+#define CRON_MAX_US_PER_SEC 20000 /* With dynamic hz, 2% of the CPU time */
 #define CONFIG_DEFAULT_SERVER_PORT       9528    /* TCP port */
-#define CONFIG_DEFAULT_CLIENT_TIMEOUT    30      /* default client timeout: infinite */
+#define CONFIG_DEFAULT_CLIENT_TIMEOUT    30      /* Seconds, 0 = never */
 #define CONFIG_DEFAULT_TCP_BACKLOG       511     /* TCP listen backlog */
 #define CONFIG_DEFAULT_TCP_KEEPALIVE 300
 #define CONFIG_DEFAULT_MAX_CLIENTS 10000
 #define CONFIG_DEFAULT_MAXMEMORY 0
+#define CONFIG_DEFAULT_MAXMEMORY_POLICY MAXMEMORY_HISTORY_CLIENTS
 #define CONFIG_BINDADDR_MAX 16
 #define CONFIG_MIN_RESERVED_FDS 32
 #define NET_IP_STR_LEN 46 /* INET6_ADDRSTRLEN is 46, but we need to be sure */
 #define LOG_MAX_LEN    1024 /* Default maximum length of syslog messages */
 #define CONFIG_DEFAULT_THREADS 10 /* Default number of threads */
 #define CONFIG_DEFAULT_MAX_TASKS 100 /* Default maximum size of thread tasks */
+#define CONFIG_DEFAULT_TASKS_LOW_WATER 50 /* Post waiting commands under this */
+#define CONFIG_DEFAULT_AUTH_CACHE_SIZE 10000 /* Verified (socket, channel) pairs */
+#define CONFIG_MAX_LINE    1024
+#define CONFIG_DEFAULT_FLUSH_DELAY 0  /* Microseconds, 0 = flush ASAP */
+#define CONFIG_MAX_FLUSH_DELAY 1000
+#define CONFIG_DEFAULT_PUBSUB_SHARDS 16 /* Must be a power of two */
+#define CONFIG_DEFAULT_CLUSTER_ANNOUNCE_IP "127.0.0.1"
+#define CONFIG_DEFAULT_CLUSTER_BLOOM_BITS (1<<20)
+#define CONFIG_DEFAULT_CLUSTER_BLOOM_HASHES 4
+#define CONFIG_DEFAULT_HISTORY_SIZE 0 /* Messages kept for RESUME */
+#define CONFIG_DEFAULT_ACTIVE_DEFRAG 0
+#define CONFIG_DEFAULT_DEFRAG_THRESHOLD 10 /* Fragmentation percentage */
+#define CONFIG_DEFAULT_DEFRAG_IGNORE_BYTES (100<<20) /* Don't defrag less */
+#define CONFIG_DEFAULT_DEFRAG_CYCLE 25 /* Percentage of CPU time */
+#define CONFIG_DEFAULT_LAZYFREE_THRESHOLD 64 /* Elements, 0 = never lazy */
+#define CONFIG_DEFAULT_LAZYFREE_MAX_TASKS 1024 /* Then free in place */
+#define CONFIG_DEFAULT_BUSY_POLL 0 /* Microseconds, 0 = always block */
+#define CONFIG_DEFAULT_BUSY_POLL_SOCKETS 0
+#define CONFIG_DEFAULT_WORKER_BUSY_POLL 0 /* Microseconds */
+#define CONFIG_DEFAULT_INLINE_COMMANDS 1
 
 /* When configuring the server eventloop, we setup it so that the total number
  * of file descriptors we can handle are server.maxclients + RESERVED_FDS +
@@ -103,15 +222,31 @@ struct server {
     /* General */
     pid_t pid;                  /* Main process pid. */
     aeEventLoop *el;
-    dict *commands;             /* Command table */
     size_t initial_memory_usage; /* Bytes used after initialization. */
 
     int ipfd[CONFIG_BINDADDR_MAX]; /* TCP socket file descriptors */
     int ipfd_count;             /* Used slots in ipfd[] */
-    list *clients;              /* List of active clients */
-    list *clients_pending_write; /* There is to write or install handler. */
+    clientList clients;         /* List of active clients */
+    clientList clients_pending_write; /* There is to write or install handler. */
+    clientList clients_to_close; /* Clients to close asynchronously */
+    clientList clients_tasks_done; /* Their last posted command completed */
+    clientList clients_waiting_pool; /* Waiting for room in the thread pool */
+    int tasks_done_pipe[2];     /* Workers wake up the event loop with it */
+    clientList timeout_wheel[CLIENT_TIMEOUT_WHEEL_SIZE]; /* Clients by the
+                                   second they time out at if idle */
+    time_t timeout_wheel_time;  /* Last second clientsTimeoutCron() did */
+    long long flush_delay;      /* Microseconds to hold back client output so
+                                   that more messages go in the same write */
+    long long flush_timer_id;   /* Timer waking us up to flush held clients */
     int hz;                     /* serverCron() calls frequency in hertz */
+    int config_hz;              /* Configured hz, the base of dynamic hz */
+    int dynamic_hz;             /* Change hz with the load */
+    long long cron_avg_us;      /* Moving average of serverCron() duration */
     int cronloops;              /* Number of times the cron function run */
+    long long busy_poll;        /* Microseconds the loop spins before blocking */
+    int busy_poll_sockets;      /* Also set SO_BUSY_POLL on client sockets */
+    long long worker_busy_poll; /* Microseconds workers spin before waiting */
+    int inline_commands;        /* Run CMD_INLINE commands on the event loop */
 
     /* Networking */
     int port;
@@ -121,6 +256,60 @@ struct server {
     uint64_t next_client_id;    /* Next client unique ID. Incremental. */
     char neterr[ANET_ERR_LEN];   /* Error buffer for anet.c */
 
+    /* Pubsub */
+    pubsubShard *pubsub_shards; /* Channels registry, by channel hash */
+    unsigned long pubsub_shards_count; /* Number of shards, power of two */
+
+    /* Cluster */
+    int cluster_enabled;        /* Is cluster enabled? */
+    int cluster_port;           /* Cluster bus port, 0 = port+10000 */
+    char *cluster_announce_ip;  /* IP the other nodes know us by */
+    list *cluster_config_nodes; /* "<ip>:<port>" of the configured nodes */
+    unsigned long long cluster_bloom_bits; /* Size of the channels filter */
+    int cluster_bloom_hashes;   /* Bits set in the filter by every channel */
+    struct clusterState *cluster; /* State of the cluster */
+    int cfd[CONFIG_BINDADDR_MAX]; /* Cluster bus listening socket */
+    int cfd_count;              /* Used slots in cfd[] */
+
+    /* Handoff */
+    char *handoff_socket;       /* Unix socket to hand clients off with */
+    int handoff_fd;             /* Listening handoff socket */
+
+    /* History and replication */
+    long long history_size;     /* Max messages kept for RESUME and SYNC */
+    historyEntry *history;      /* Latest messages, the message with sequence
+                                   number N is at N % history_size. */
+    long long history_len;      /* Messages in the history */
+    long long history_seq;      /* Sequence number of the latest message */
+    clientList replicas;        /* Replicas fed with every message */
+    char *masterhost;           /* Hostname of the master, NULL if master */
+    int masterport;             /* Port of the master */
+    char *repl_password;        /* Required by SYNC and REPLICAOF, and sent
+                                   to the master. NULL disables both. */
+    int repl_changed;           /* REPLICAOF changed the master */
+    int repl_fd;                /* Link with the master, -1 if none */
+    sds repl_rcvbuf;            /* Partial line read from the master */
+    int repl_synced;            /* The master accepted our SYNC */
+    mstime_t repl_connect_time; /* Last connection attempt to the master */
+
+    /* Active defragmentation */
+    int active_defrag_enabled;
+    int active_defrag_threshold; /* Fragmentation percentage to start at */
+    size_t active_defrag_ignore_bytes; /* Fragmentation bytes to start at */
+    int active_defrag_cycle;    /* Max percentage of CPU time to spend */
+    int active_defrag_running;  /* A defrag pass is in progress */
+
+    /* Lazy free */
+    int lazyfree_threshold;     /* Elements over which to free in background */
+    long long lazyfree_pending_objects; /* Posted and not freed yet */
+
+    /* Channels authentication */
+    char *app_key;              /* Key expected in auth signatures */
+    char *app_secret;           /* Secret used to sign channel auths */
+    dict *auth_cache;           /* "<socket id>" -> channel -> verified auth */
+    long auth_cache_len;        /* Channel auths in auth_cache */
+    int auth_cache_size;        /* Max number of channel auths cached */
+
     /* time cache */
     time_t unixtime;
     long long mstime;   /* Like 'unixtime' but with milliseconds resolution. */
@@ -133,10 +322,29 @@ struct server {
     /* Limits */
     unsigned int maxclients;            /* Max number of simultaneous clients */
     unsigned long long maxmemory;   /* Max number of memory bytes to use */
+    int maxmemory_policy;           /* MAXMEMORY_* */
     thread_pool_t *tpool;  /* thread pool */
+    thread_pool_t *lazyfree_pool; /* Thread freeing large structures */
+
+    /* CPU affinity */
+    pthread_t main_thread;
+    char *server_cpulist;       /* CPUs of the main thread, NULL = any */
+    char *worker_cpulist;       /* CPUs of the thread pool workers */
+    char *lazyfree_cpulist;     /* CPUs of the lazyfree thread */
 
     /* Fields used only for stats */
     long long stat_rejected_conn;   /* Clients rejected because of maxclients */
+    long long stat_conflated_messages; /* Pending messages dropped for a newer one */
+    long long stat_active_defrag_hits; /* Allocations moved by defrag */
+    long long stat_active_defrag_misses; /* Allocations defrag left alone */
+    long long stat_evicted_messages; /* History messages freed by maxmemory */
+    long long stat_evicted_clients; /* Clients closed by maxmemory */
+    long long stat_oom_rejected_publishes; /* Refused by maxmemory */
+    long long stat_lazyfreed_objects; /* Freed by the lazyfree thread */
+    long long stat_inline_commands; /* Run on the event loop */
+    long long stat_offloaded_commands; /* Posted to the thread pool */
+    long long stat_reads_pauses; /* Commands that waited for the pool */
+    long long stat_reads_paused_us; /* Total time they waited */
 
     /* System hardware info */
     size_t system_memory_size;  /* Total memory in system as reported by OS */
@@ -145,13 +353,23 @@ struct server {
      * not available. */
     pthread_mutex_t next_client_id_mutex;
     pthread_mutex_t lock;
+    pthread_mutex_t auth_lock;  /* Protects auth_cache */
+    pthread_mutex_t history_lock; /* Protects history and replicas */
+    pthread_mutex_t repl_lock;  /* Protects masterhost and repl_changed */
 };
 
+/* Command flags. Commands run in the thread pool unless they are cheap
+ * enough that posting them would cost more than running them. */
+#define CMD_INLINE (1<<0)   /* Run on the event loop */
+#define CMD_AUTH (1<<1)     /* Verifies the auth of the channel in argv[1]:
+                               offloaded if the channel requires one */
+
 typedef void pusherCommandProc(client *c);
 struct pusherCommand {
     char *name;
     pusherCommandProc *proc;
     int arity;
+    int flags;                  /* CMD_* */
     long long microseconds, calls;
 };
 
@@ -160,6 +378,14 @@ struct pusherCommand {
  *----------------------------------------------------------------------------*/
 
 extern struct server server;
+extern dictType pubsubChannelsDictType;
+extern dictType clientPubsubChannelsDictType;
+extern dictType presenceMembersDictType;
+extern dictType authCacheDictType;
+extern dictType authClientCacheDictType;
+extern dictType clientConflatedDictType;
+extern dictType clientConflatedNodesDictType;
+extern dictType clusterNodesDictType;
 
 /*-----------------------------------------------------------------------------
  * Functions prototypes
@@ -168,6 +394,50 @@ extern struct server server;
 /* Core functions */
 struct pusherCommand *lookupCommand(sds name);
 void populateCommandTable(void);
+int listenToPort(int port, int *fds, int *count);
+void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+
+/* Configuration */
+void loadServerConfig(char *filename, char *options);
+const char *maxmemoryPolicyName(int policy);
+
+/* defrag.c -- Active defragmentation */
+void activeDefragCycle(void);
+
+/* evict.c -- Maxmemory enforcement */
+int evictMemoryIfNeeded(int cron);
+size_t evictUsedMemory(void);
+
+/* timeout.c -- Idle clients timeout */
+void clientsTimeoutInit(void);
+void clientsTimeoutAdd(client *c);
+void clientsTimeoutRemove(client *c);
+void clientsTimeoutCron(void);
+
+/* lazyfree.c -- Release of large structures in background */
+void lazyfreeInit(void);
+void lazyfreeObject(void (*freefn)(void *ptr), void *ptr,
+                    unsigned long effort);
+void lazyfreeList(list *l);
+void lazyfreeDict(dict *d);
+
+/* setcpuaffinity.c -- Threads pinning */
+int cpulistIsValid(const char *cpulist);
+void setcpuaffinity(const char *name, const char *cpulist);
+sds catcpuaffinity(sds s, pthread_t thread);
+int numaNodesCount(void);
+
+/* handoff.c -- Restarts without dropping connections */
+void handoffInit(void);
+void handoffReceive(void);
+void handoffRestoreClients(void);
+sds handoffCatField(sds s, const char *p, size_t len);
+
+/* auth.c -- Private and presence channels authentication */
+int pubsubChannelRequiresAuth(sds channel);
+int authVerifyChannel(client *c, sds channel, sds auth, sds channel_data);
+int authCheckPassword(const char *password, const char *given);
+void authCacheUnlinkClient(client *c);
 
 /* Utils */
 long long ustime(void);
@@ -175,13 +445,24 @@ long long mstime(void);
 void serverLog(int level, const char *fmt, ...);
 
 /* networking.c -- Networking and Client related operations */
+void clientListInit(clientList *l, int id);
+void clientListAddHead(clientList *l, client *c);
+void clientListAddTail(clientList *l, client *c);
+void clientListDel(clientList *l, client *c);
+int clientListContains(clientList *l, client *c);
+void clientListRotate(clientList *l);
 client *createClient(int fd);
 void closeTimedoutClients(void);
 void freeClient(client *c);
 void freeClientAsync(client *c);
+void freeClientsInAsyncFreeQueue(void);
+void tasksDoneInit(void);
+void postWaitingCommands(void);
 void resetClient(client *c);
 void addReplySds(client *c, sds s);
 void addReplyString(client *c, const char *s, size_t len);
+void addReplyProto(client *c, const char *s, size_t len);
+void addReplyConflated(client *c, sds key, const char *s, size_t len);
 void addReplyLongLongWithPrefix(client *c, long long ll, char prefix);
 void addReplyLongLong(client *c, long long ll);
 void addReplyError(client *c, const char *err);
@@ -192,10 +473,43 @@ int handleClientsWithPendingWrites(void);
 
 /* Commands prototypes */
 void pingCommand(client *c);
+void infoCommand(client *c);
+sds genPusherInfoString(char *section);
 
 /* pubsub.c -- Pub/Sub related operations */
+void pubsubInitShards(void);
+void pubsubLockAllShards(int lock);
+void freePubsubChannel(pubsubChannel *ch);
+void freePresenceMember(presenceMember *m);
+void freePubsubSubscription(pubsubSubscription *sub);
+int pubsubIsPresenceChannel(sds channel);
+int pubsubSubscribeChannel(client *c, sds channel, sds user_id, sds user_info,
+                           long long since);
+int pubsubUnsubscribeChannel(client *c, sds channel, int notify);
+int pubsubUnsubscribeAllChannels(client *c, int notify);
+void pubsubUnlinkClient(client *c);
+sds pubsubDumpSubscriptions(client *c, sds s);
+void pubsubRestoreSubscription(client *c, sds channel, sds user_id,
+                               sds user_info);
+int pubsubPublishMessage(sds channel, sds message, sds key, long long seq);
+int pubsubHasLineBreak(sds s);
+void historyInit(void);
+long long historyAdd(sds channel, sds message, sds key, long long seq);
+long long historyEvictOldest(long long count);
+void subscribeCommand(client *c);
+void resumeCommand(client *c);
+void unsubscribeCommand(client *c);
 void publishCommand(client *c);
 
+/* replication.c -- Master to replica publish stream */
+sds replicationPubLine(historyEntry *he);
+void replicationFeedReplicas(historyEntry *he);
+void replicationUnlinkReplica(client *c);
+int replicationIsReplica(void);
+void replicationCron(void);
+void syncCommand(client *c);
+void replicaofCommand(client *c);
+
 /* Debugging stuff */
 void _serverAssert(const char *estr, const char *file, int line);
 void _serverPanic(const char *file, int line, const char *msg, ...);
@@ -0,0 +1,139 @@
+#include "server.h"
+
+#ifdef USE_SETCPUAFFINITY
+#include <sched.h>
+#include <ctype.h>
+#include <dirent.h>
+#endif
+
+/*-----------------------------------------------------------------------------
+ * CPU affinity
+ *
+ * The main thread, the thread pool workers and the lazyfree thread can be
+ * pinned to a list of CPUs, given like "0-3,8,10-15:2" (CPUs 0 to 3, 8,
+ * and every second CPU from 10 to 15). A pinned thread also gets its own
+ * allocator arena, so that the memory it allocates stays on its node.
+ *----------------------------------------------------------------------------*/
+
+#ifdef USE_SETCPUAFFINITY
+
+/* Parse a number at *p, moving *p after it. Returns -1 without digits. */
+static long cpulistNumber(const char **p) {
+    long n = 0;
+
+    if (!isdigit((unsigned char)**p)) return -1;
+    while (isdigit((unsigned char)**p)) {
+        n = n*10+(**p-'0');
+        if (n >= CPU_SETSIZE) return -1;
+        (*p)++;
+    }
+    return n;
+}
+
+/* Parse 'cpulist' into 'set'. Returns C_ERR on syntax errors. */
+static int cpulistParse(const char *cpulist, cpu_set_t *set) {
+    const char *p = cpulist;
+
+    CPU_ZERO(set);
+    while (1) {
+        long a, b, stride = 1;
+
+        if ((a = b = cpulistNumber(&p)) == -1) return C_ERR;
+        if (*p == '-') {
+            p++;
+            if ((b = cpulistNumber(&p)) == -1 || b < a) return C_ERR;
+            if (*p == ':') {
+                p++;
+                if ((stride = cpulistNumber(&p)) <= 0) return C_ERR;
+            }
+        }
+        for (; a <= b; a += stride) CPU_SET(a,set);
+        if (*p == '\0') return C_OK;
+        if (*p++ != ',') return C_ERR;
+    }
+}
+
+int cpulistIsValid(const char *cpulist) {
+    cpu_set_t set;
+
+    return cpulistParse(cpulist,&set) == C_OK && CPU_COUNT(&set) > 0;
+}
+
+/* Pin the calling thread to 'cpulist', if not NULL, and give it an arena
+ * of its own. 'name' is only used for logging. */
+void setcpuaffinity(const char *name, const char *cpulist) {
+    cpu_set_t set;
+    int err;
+
+    if (cpulist == NULL) return;
+    if (cpulistParse(cpulist,&set) == C_ERR) return;
+    err = pthread_setaffinity_np(pthread_self(),sizeof(set),&set);
+    if (err) {
+        serverLog(LL_WARNING,"Unable to pin the %s thread to CPUs %s: %s",
+            name, cpulist, strerror(err));
+        return;
+    }
+    zmalloc_thread_local_arena();
+}
+
+/* Append to 's' the CPUs 'thread' may run on, in the cpulist format. */
+sds catcpuaffinity(sds s, pthread_t thread) {
+    cpu_set_t set;
+    int cpu, first = -1, sep = 0;
+
+    if (pthread_getaffinity_np(thread,sizeof(set),&set) != 0)
+        return sdscat(s,"unknown");
+    for (cpu = 0; cpu <= CPU_SETSIZE; cpu++) {
+        int in = cpu < CPU_SETSIZE && CPU_ISSET(cpu,&set);
+
+        if (in && first == -1) {
+            first = cpu;
+        } else if (!in && first != -1) {
+            if (sep++) s = sdscatlen(s,",",1);
+            if (first == cpu-1)
+                s = sdscatfmt(s,"%i",first);
+            else
+                s = sdscatfmt(s,"%i-%i",first,cpu-1);
+            first = -1;
+        }
+    }
+    return s;
+}
+
+/* Number of NUMA nodes, as listed in sysfs, 1 if unknown. */
+int numaNodesCount(void) {
+    DIR *dir = opendir("/sys/devices/system/node");
+    struct dirent *de;
+    int count = 0;
+
+    if (dir == NULL) return 1;
+    while ((de = readdir(dir)) != NULL) {
+        if (!strncmp(de->d_name,"node",4) &&
+            isdigit((unsigned char)de->d_name[4])) count++;
+    }
+    closedir(dir);
+    return count ? count : 1;
+}
+
+#else /* USE_SETCPUAFFINITY */
+
+int cpulistIsValid(const char *cpulist) {
+    UNUSED(cpulist);
+    return 0;
+}
+
+void setcpuaffinity(const char *name, const char *cpulist) {
+    UNUSED(name);
+    UNUSED(cpulist);
+}
+
+sds catcpuaffinity(sds s, pthread_t thread) {
+    UNUSED(thread);
+    return sdscat(s,"unknown");
+}
+
+int numaNodesCount(void) {
+    return 1;
+}
+
+#endif
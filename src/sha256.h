@@ -0,0 +1,25 @@
+/* SHA-256 and HMAC-SHA256, as specified by FIPS 180-4 and RFC 2104.
+ * Used to verify the signatures of private and presence channels. */
+
+#ifndef __SHA256_H
+#define __SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_BLOCK_SIZE 32    /* SHA256 outputs a 32 byte digest */
+
+typedef struct {
+    uint8_t data[64];
+    uint32_t datalen;
+    unsigned long long bitlen;
+    uint32_t state[8];
+} SHA256_CTX;
+
+void sha256_init(SHA256_CTX *ctx);
+void sha256_update(SHA256_CTX *ctx, const uint8_t data[], size_t len);
+void sha256_final(SHA256_CTX *ctx, uint8_t hash[]);
+void hmac_sha256(const uint8_t *key, size_t keylen, const uint8_t *msg,
+                 size_t msglen, uint8_t hash[]);
+
+#endif /* __SHA256_H */
@@ -0,0 +1,158 @@
+#include "slab.h"
+#include "zmalloc.h"
+#include "atomicvar.h"
+
+#include <pthread.h>
+
+/* A free object. The depot keeps full batches of SLAB_BATCH objects, linked
+ * through the first object of every batch. */
+typedef struct slabObject {
+    struct slabObject *next;        /* Next free object of the batch */
+    struct slabObject *next_batch;  /* Next batch in the depot */
+} slabObject;
+
+typedef struct slabThreadCache {
+    slabObject *free;               /* Free objects of this thread */
+    int count;                      /* Number of objects in 'free' */
+} slabThreadCache;
+
+static __thread slabThreadCache thread_caches[SLAB_CACHES];
+
+/* Bytes of the free objects, in all the caches, depot included. Like the
+ * zmalloc counters every thread has its own slot, and objects freed by
+ * another thread than the one that allocated them make the slots drift
+ * apart while keeping their sum exact. */
+#define SLAB_THREAD_SLOTS 64
+#define SLAB_CACHE_LINE 64
+
+typedef struct slabSlot {
+    size_t free_memory;
+    char padding[SLAB_CACHE_LINE-sizeof(size_t)];
+} __attribute__((aligned(SLAB_CACHE_LINE))) slabSlot;
+
+static slabSlot free_memory[SLAB_THREAD_SLOTS];
+static int next_slot = 0;
+static __thread slabSlot *thread_slot = NULL;
+
+static slabSlot *slabThreadSlot(void) {
+    if (thread_slot == NULL) {
+        int slot;
+
+        atomicGetIncr(next_slot,slot,1);
+        thread_slot = free_memory+(slot % SLAB_THREAD_SLOTS);
+    }
+    return thread_slot;
+}
+
+/* The size of the objects actually carved from the slabs. */
+static size_t slabObjectSize(size_t size) {
+    if (size < sizeof(slabObject)) size = sizeof(slabObject);
+    return (size+sizeof(void*)-1) & ~(sizeof(void*)-1);
+}
+
+/* Threads only go to the depot once every SLAB_BATCH objects, so a single
+ * lock for all the caches is enough. */
+static pthread_mutex_t depot_lock = PTHREAD_MUTEX_INITIALIZER;
+static slabObject *depot[SLAB_CACHES];
+
+/* Object size of every cache, known once its first slab is carved. */
+static size_t object_sizes[SLAB_CACHES];
+
+/* Give an empty thread cache a batch of objects, from the depot if it has
+ * any, or carved from a new slab. Slabs are never returned to the
+ * allocator, their objects are reused instead. */
+static void slabRefill(slabThreadCache *tc, int cache, size_t size) {
+    slabObject *batch;
+    char *slab;
+    int j;
+
+    pthread_mutex_lock(&depot_lock);
+    batch = depot[cache];
+    if (batch) depot[cache] = batch->next_batch;
+    pthread_mutex_unlock(&depot_lock);
+
+    if (batch == NULL) {
+        size = slabObjectSize(size);
+        slab = zmalloc(size*SLAB_BATCH);
+        atomicSet(object_sizes[cache],size);
+        atomicIncr(slabThreadSlot()->free_memory,size*SLAB_BATCH);
+        for (j = 0; j < SLAB_BATCH; j++) {
+            slabObject *obj = (slabObject*)(slab+size*j);
+            obj->next = j == SLAB_BATCH-1 ? NULL :
+                        (slabObject*)(slab+size*(j+1));
+        }
+        batch = (slabObject*)slab;
+    }
+    tc->free = batch;
+    tc->count = SLAB_BATCH;
+}
+
+/* Allocate an object of 'size' bytes from the given cache. The size must
+ * be the same at every call for a cache. */
+void *slabAlloc(int cache, size_t size) {
+#ifdef __SANITIZE_ADDRESS__
+    /* Let the address sanitizer see every object. */
+    (void)cache;
+    return zmalloc(size);
+#else
+    slabThreadCache *tc = thread_caches+cache;
+    slabObject *obj;
+
+    if (tc->free == NULL) slabRefill(tc,cache,size);
+    obj = tc->free;
+    tc->free = obj->next;
+    tc->count--;
+    atomicDecr(slabThreadSlot()->free_memory,slabObjectSize(size));
+    return obj;
+#endif
+}
+
+/* Release an object allocated with slabAlloc(), possibly by another
+ * thread. */
+void slabFree(int cache, void *ptr) {
+#ifdef __SANITIZE_ADDRESS__
+    (void)cache;
+    zfree(ptr);
+#else
+    slabThreadCache *tc = thread_caches+cache;
+    slabObject *obj = ptr, *first, *last;
+    size_t size;
+    int j;
+
+    if (ptr == NULL) return;
+    atomicGet(object_sizes[cache],size);
+    atomicIncr(slabThreadSlot()->free_memory,size);
+    obj->next = tc->free;
+    tc->free = obj;
+
+    /* Keep at most two batches, so that a thread that goes on allocating
+     * and freeing around the same count doesn't go to the depot every
+     * time. */
+    if (++tc->count < SLAB_BATCH*2) return;
+    first = last = tc->free;
+    for (j = 1; j < SLAB_BATCH; j++) last = last->next;
+    tc->free = last->next;
+    tc->count -= SLAB_BATCH;
+    last->next = NULL;
+
+    pthread_mutex_lock(&depot_lock);
+    first->next_batch = depot[cache];
+    depot[cache] = first;
+    pthread_mutex_unlock(&depot_lock);
+#endif
+}
+
+/* Bytes allocated for the slabs and not in use: they are never given back
+ * to the allocator, so zmalloc_used_memory() still counts them. */
+size_t slabFreeMemory(void) {
+    size_t fm = 0, slot_fm;
+    int j, slots;
+
+    atomicGet(next_slot,slots);
+    if (slots > SLAB_THREAD_SLOTS) slots = SLAB_THREAD_SLOTS;
+    for (j = 0; j < slots; j++) {
+        atomicGet(free_memory[j].free_memory,slot_fm);
+        fm += slot_fm;
+    }
+    return fm;
+}
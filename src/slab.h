@@ -0,0 +1,29 @@
+/* Slab caches for the small objects of fixed size allocated and freed all
+ * the time: list nodes, dict entries, thread pool tasks and clients.
+ *
+ * Every thread keeps a free list of objects for every cache, so most
+ * allocations and releases don't even take a lock. Threads freeing more
+ * objects than they allocate (the workers free the tasks allocated by the
+ * main thread) give them back in batches to a global depot, where the
+ * threads running out of objects take them. */
+
+#ifndef __SLAB_H
+#define __SLAB_H
+
+#include <stddef.h>
+
+#define SLAB_BATCH 64          /* Objects moved at once to/from the depot */
+
+/* The caches. The size of the objects is given at every call, so that this
+ * file doesn't depend on the modules using it. */
+#define SLAB_LIST_NODE 0
+#define SLAB_DICT_ENTRY 1
+#define SLAB_THREAD_TASK 2
+#define SLAB_CLIENT 3
+#define SLAB_CACHES 4
+
+void *slabAlloc(int cache, size_t size);
+void slabFree(int cache, void *ptr);
+size_t slabFreeMemory(void);
+
+#endif /* __SLAB_H */
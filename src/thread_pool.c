@@ -1,5 +1,7 @@
 #include "server.h"
 #include "thread_pool.h"
+#include "slab.h"
+#include "atomicvar.h"
 
 
 static void *thread_pool_cycle(void *data);
@@ -10,12 +12,12 @@ static uint64_t thread_pool_task_id;
 
 static int thread_pool_init(thread_pool_t *tp) {
     int             err;
-    pthread_t       tid;
     pthread_attr_t  attr;
     int j;
 
     pthread_mutex_init(&tp->mtx, NULL);
     pthread_cond_init(&tp->cond, NULL);
+    pthread_mutex_init(&tp->queued_mutex, NULL);
     pthread_attr_init(&attr);
 
     err = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
@@ -33,7 +35,7 @@ static int thread_pool_init(thread_pool_t *tp) {
 #endif
 
     for (j = 0; j < tp->thread_count; j++) {
-        err = pthread_create(&tid, &attr, thread_pool_cycle, tp);
+        err = pthread_create(tp->threads+j, &attr, thread_pool_cycle, tp);
         if (err) {
             serverLog(LL_WARNING, "pthread_create() failed");
             return C_ERR;
@@ -45,14 +47,24 @@ static int thread_pool_init(thread_pool_t *tp) {
     return C_OK;
 }
 
-thread_pool_t *thread_pool_create(char *name, int thread_count, int maxtasks) {
+thread_pool_t *thread_pool_create(char *name, int thread_count, int maxtasks,
+                                  const char *cpulist)
+{
     thread_pool_t *tp;
 
     if ((tp = zmalloc(sizeof(*tp))) == NULL) return NULL;
     tp->tasks = listCreate();
     tp->name = name;
     tp->thread_count = thread_count;
+    tp->threads = zcalloc(sizeof(pthread_t)*thread_count);
+    tp->cpulist = cpulist;
     tp->maxtasks = maxtasks;
+    tp->running = 0;
+    tp->queued = 0;
+    tp->spin = 0;
+    tp->spinning = 0;
+    tp->spin_hits = 0;
+    tp->parks = 0;
     thread_pool_init(tp);
     return tp;
 }
@@ -78,6 +90,8 @@ void thread_pool_destroy(thread_pool_t *tp) {
 
     pthread_cond_destroy(&tp->cond);
     pthread_mutex_destroy(&tp->mtx);
+    pthread_mutex_destroy(&tp->queued_mutex);
+    zfree(tp->threads);
     zfree(tp);
 }
 
@@ -89,6 +103,40 @@ static void thread_pool_exit_handler(void *data) {
     pthread_exit(0);
 }
 
+static inline void thread_pool_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/* Called with tp->mtx held and no task queued: release the mutex and spin
+ * up to tp->spin microseconds waiting for one, so that a task posted soon
+ * doesn't pay for waking up a sleeping thread. While spinning the thread
+ * is counted in tp->spinning, so that posters don't wake up another one
+ * for the task. A thread losing the task to another one goes on spinning
+ * until its deadline. The mutex is held again on return, and the return
+ * value is 1 if a task is queued. */
+static int thread_pool_spin(thread_pool_t *tp) {
+    long long deadline = ustime()+tp->spin, queued;
+
+    tp->spinning++;
+    do {
+        pthread_mutex_unlock(&tp->mtx);
+        do {
+            thread_pool_cpu_relax();
+            atomicGet(tp->queued, queued);
+        } while (queued == 0 && ustime() < deadline);
+        pthread_mutex_lock(&tp->mtx);
+    } while (listLength(tp->tasks) == 0 && ustime() < deadline);
+    tp->spinning--;
+
+    if (listLength(tp->tasks) == 0) return 0;
+    tp->spin_hits++;
+    return 1;
+}
+
 static void *thread_pool_cycle(void *data) {
     thread_pool_t *tp = data;
 
@@ -112,17 +160,25 @@ static void *thread_pool_cycle(void *data) {
         return NULL;
     }
 
+    setcpuaffinity(tp->name, tp->cpulist);
+
     for ( ;; ) {
         pthread_mutex_lock(&tp->mtx);
 
+        /* A thread that spun for nothing is about to sleep. */
+        if (listLength(tp->tasks) == 0 && tp->spin && !thread_pool_spin(tp))
+            tp->parks++;
+
         while (listLength(tp->tasks) == 0) {
             pthread_cond_wait(&tp->cond, &tp->mtx);
         }
 
         head = listFirst(tp->tasks);
-        listDelNode(tp->tasks, head);
         task = listNodeValue(head);
-        
+        listDelNode(tp->tasks, head);
+        atomicDecr(tp->queued, 1);
+        tp->running++;
+
         pthread_mutex_unlock(&tp->mtx);
 
         serverLog(LL_DEBUG, "run task #%u in thread pool \"%s\"",
@@ -130,15 +186,21 @@ static void *thread_pool_cycle(void *data) {
 
         task->handler(task->data);
 
-        if (task->free) task->free(task->data);
-        zfree(task);
-
         serverLog(LL_DEBUG, "complete task #%u in thread pool \"%s\"",
             task->id, tp->name);
+
+        if (task->free) task->free(task->data);
+        slabFree(SLAB_THREAD_TASK,task);
+
+        pthread_mutex_lock(&tp->mtx);
+        tp->running--;
+        pthread_mutex_unlock(&tp->mtx);
     }
 }
 
 int thread_task_post(thread_pool_t *tp, thread_task_t *task) {
+    uint64_t id;
+
     pthread_mutex_lock(&tp->mtx);
 
     if (listLength(tp->tasks) >= tp->maxtasks) {
@@ -150,17 +212,44 @@ int thread_task_post(thread_pool_t *tp, thread_task_t *task) {
         return C_ERR;
     }
 
-    task->id = thread_pool_task_id++;
-
-    pthread_cond_signal(&tp->cond);
+    id = task->id = thread_pool_task_id++;
 
     listAddNodeTail(tp->tasks, task);
+    atomicIncr(tp->queued, 1);
+
+    /* The spinning threads take the queued tasks without being woken up,
+     * only wake up a sleeping one for the tasks left over. */
+    if (listLength(tp->tasks) > tp->spinning) pthread_cond_signal(&tp->cond);
 
     pthread_mutex_unlock(&tp->mtx);
 
+    /* Don't touch the task anymore: a worker may have already run it. */
     serverLog(LL_WARNING, 
         "task #%u added to thread pool \"%s\"",
-        task->id, tp->name);
+        id, tp->name);
 
     return C_OK;
 }
+
+/* Wait until every task posted so far was run. Only useful when no more
+ * tasks are being posted. */
+void thread_pool_wait_idle(thread_pool_t *tp) {
+    for ( ;; ) {
+        int idle;
+
+        pthread_mutex_lock(&tp->mtx);
+        idle = listLength(tp->tasks) == 0 && tp->running == 0;
+        pthread_mutex_unlock(&tp->mtx);
+
+        if (idle) return;
+        usleep(1000);
+    }
+}
+
+/* Have the idle threads spin up to 'usec' microseconds for a new task
+ * before going to sleep, 0 to sleep at once. */
+void thread_pool_set_spin(thread_pool_t *tp, long long usec) {
+    pthread_mutex_lock(&tp->mtx);
+    tp->spin = usec;
+    pthread_mutex_unlock(&tp->mtx);
+}
@@ -18,12 +18,24 @@ typedef struct thread_pool_s {
     pthread_cond_t cond;
     char *name;
     int thread_count;
+    pthread_t *threads;
+    const char *cpulist;    /* CPUs the threads are pinned to, or NULL */
     list *tasks;
     unsigned int maxtasks;
+    unsigned int running;   /* Tasks being run by a thread */
+    long long queued;       /* Length of tasks, readable without mtx */
+    pthread_mutex_t queued_mutex;
+    long long spin;         /* Microseconds to spin before waiting, or 0 */
+    unsigned int spinning;  /* Threads spinning, they need no signal */
+    long long spin_hits;    /* Tasks found while spinning */
+    long long parks;        /* Spins that ended up waiting */
 } thread_pool_t;
 
-thread_pool_t *thread_pool_create(char *name, int thread_count, int maxtasks);
+thread_pool_t *thread_pool_create(char *name, int thread_count, int maxtasks,
+                                  const char *cpulist);
 void thread_pool_destroy(thread_pool_t *tp);
 int thread_task_post(thread_pool_t *tp, thread_task_t *task);
+void thread_pool_wait_idle(thread_pool_t *tp);
+void thread_pool_set_spin(thread_pool_t *tp, long long usec);
 
 #endif /* __THREAD_POOL_H_ */
@@ -0,0 +1,72 @@
+#include "server.h"
+
+/*-----------------------------------------------------------------------------
+ * Idle clients timeout
+ *
+ * Clients are kept in a timing wheel of CLIENT_TIMEOUT_WHEEL_SIZE buckets,
+ * one per second, in the bucket of the second they would expire at if
+ * they stayed idle from when they were put there. Activity only updates
+ * c->lastinteraction, the client is moved when its bucket comes: if it was
+ * active in the meantime it goes to the bucket of its new deadline,
+ * otherwise it is closed. So the cron only looks at the clients of the
+ * buckets whose second passed, instead of at every client.
+ *
+ * Deadlines more than CLIENT_TIMEOUT_WHEEL_SIZE seconds away just wait a
+ * full turn of the wheel once more.
+ *----------------------------------------------------------------------------*/
+
+void clientsTimeoutInit(void) {
+    int j;
+
+    for (j = 0; j < CLIENT_TIMEOUT_WHEEL_SIZE; j++)
+        clientListInit(server.timeout_wheel+j,CLIENT_LIST_TIMEOUT);
+    server.timeout_wheel_time = server.unixtime;
+}
+
+static clientList *clientsTimeoutBucket(time_t t) {
+    return server.timeout_wheel+(t & (CLIENT_TIMEOUT_WHEEL_SIZE-1));
+}
+
+/* Put 'c' in the bucket of its deadline. Replicas never send anything
+ * after SYNC, so they never time out. */
+void clientsTimeoutAdd(client *c) {
+    if (server.maxidletime == 0 || (c->flags & CLIENT_REPLICA)) return;
+    c->timeout_at = c->lastinteraction+server.maxidletime+1;
+    clientListAddTail(clientsTimeoutBucket(c->timeout_at),c);
+}
+
+void clientsTimeoutRemove(client *c) {
+    if (c->timeout_at == 0) return;
+    clientListDel(clientsTimeoutBucket(c->timeout_at),c);
+    c->timeout_at = 0;
+}
+
+/* Close the clients idle for more than server.maxidletime seconds, looking
+ * only at the buckets of the seconds elapsed since the last call. */
+void clientsTimeoutCron(void) {
+    time_t now = server.unixtime;
+    int buckets = 0;
+
+    while (server.timeout_wheel_time < now &&
+           buckets++ < CLIENT_TIMEOUT_WHEEL_SIZE)
+    {
+        clientList *bucket =
+            clientsTimeoutBucket(++server.timeout_wheel_time);
+        unsigned long count = clientListLength(bucket);
+        client *c;
+
+        /* Clients re-added may go back to this same bucket, one turn of
+         * the wheel later: only look at the ones already there. */
+        while (count-- && (c = clientListFirst(bucket)) != NULL) {
+            clientsTimeoutRemove(c);
+            if (c->flags & CLIENT_REPLICA) continue;
+            if (c->lastinteraction+server.maxidletime < now) {
+                serverLog(LL_VERBOSE, "Closing idle client");
+                freeClient(c);
+            } else {
+                clientsTimeoutAdd(c);
+            }
+        }
+    }
+    server.timeout_wheel_time = now;
+}
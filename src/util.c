@@ -13,6 +13,65 @@
 
 #include "util.h"
 
+/* Convert a string representing an amount of memory into the number of
+ * bytes, so for instance memtoll("1Gb") will return 1073741824 that is
+ * (1024*1024*1024).
+ *
+ * On parsing error, if *err is not NULL, it's set to 1, otherwise it's
+ * set to 0. On error the function return value is 0, regardless of the
+ * fact 'err' is NULL or not. */
+long long memtoll(const char *p, int *err) {
+    const char *u;
+    char buf[128];
+    long mul; /* unit multiplier */
+    long long val;
+    unsigned int digits;
+
+    if (err) *err = 0;
+
+    /* Search the first non digit character. */
+    u = p;
+    if (*u == '-') u++;
+    while(*u && isdigit(*u)) u++;
+    if (*u == '\0' || !strcasecmp(u,"b")) {
+        mul = 1;
+    } else if (!strcasecmp(u,"k")) {
+        mul = 1000;
+    } else if (!strcasecmp(u,"kb")) {
+        mul = 1024;
+    } else if (!strcasecmp(u,"m")) {
+        mul = 1000*1000;
+    } else if (!strcasecmp(u,"mb")) {
+        mul = 1024*1024;
+    } else if (!strcasecmp(u,"g")) {
+        mul = 1000L*1000*1000;
+    } else if (!strcasecmp(u,"gb")) {
+        mul = 1024L*1024*1024;
+    } else {
+        if (err) *err = 1;
+        return 0;
+    }
+
+    /* Copy the digits into a buffer, we'll use strtoll() to convert
+     * the digit (without the unit) into a number. */
+    digits = u-p;
+    if (digits >= sizeof(buf)) {
+        if (err) *err = 1;
+        return 0;
+    }
+    memcpy(buf,p,digits);
+    buf[digits] = '\0';
+
+    char *endptr;
+    errno = 0;
+    val = strtoll(buf,&endptr,10);
+    if ((val == 0 && errno == EINVAL) || *endptr != '\0') {
+        if (err) *err = 1;
+        return 0;
+    }
+    return val*mul;
+}
+
 /* Convert a long long into a string. Returns the number of
  * characters needed to represent the number.
  * If the buffer is not big enough to store the string, 0 is returned.
@@ -175,6 +234,31 @@ uint32_t digits10(uint64_t v) {
     return 12 + digits10(v / 1000000000000UL);
 }
 
+/* Fill 'p' with 'len' random bytes from /dev/urandom, or if it can't be
+ * read, with bytes derived from the time and the pid, which is still
+ * better than a fixed value. */
+void getRandomBytes(unsigned char *p, size_t len) {
+    FILE *fp = fopen("/dev/urandom","r");
+    struct timeval tv;
+    uint64_t x;
+
+    if (fp) {
+        size_t nread = fread(p,1,len,fp);
+        fclose(fp);
+        if (nread == len) return;
+    }
+
+    gettimeofday(&tv,NULL);
+    x = ((uint64_t)tv.tv_sec*1000000+tv.tv_usec) ^ ((uint64_t)getpid()<<32);
+    while (len--) {
+        /* splitmix64 */
+        uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z>>30))*0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z>>27))*0x94d049bb133111ebull;
+        *p++ = (unsigned char)(z ^ (z>>31));
+    }
+}
+
 /* Like digits10() but for signed values. */
 uint32_t sdigits10(int64_t v) {
     if (v < 0) {
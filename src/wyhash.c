@@ -0,0 +1,112 @@
+/*
+   wyhash, by Wang Yi <godspeed_china@yeah.net>
+
+   This is free and unencumbered software released into the public domain
+   (The Unlicense, see <http://unlicense.org/>).
+
+   ----------------------------------------------------------------------------
+
+   This version of the final 4 variant was modified in the following ways:
+
+   1. Only the hash function itself is kept, with the default secret. The
+      seed is the only key.
+   2. Provide a portable 64x64->128 multiplication for compilers without
+      __uint128_t.
+
+   wyhash is not a cryptographic hash: it is two to four times faster than
+   SipHash on short strings, but a seed does not make it safe against hash
+   flooding. Only use it for tables whose keys can't be chosen freely by
+   the clients.
+ */
+#include <stdint.h>
+#include <string.h>
+
+static const uint64_t wyhash_secret[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+    0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+};
+
+/* 128 bits product of A and B, low half in A and high half in B. */
+static inline void wymum(uint64_t *A, uint64_t *B) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = *A;
+    r *= *B;
+    *A = (uint64_t)r;
+    *B = (uint64_t)(r>>64);
+#else
+    uint64_t ha = *A>>32, hb = *B>>32, la = (uint32_t)*A, lb = (uint32_t)*B;
+    uint64_t rh = ha*hb, rm0 = ha*lb, rm1 = hb*la, rl = la*lb;
+    uint64_t t = rl+(rm0<<32), c = t < rl, lo, hi;
+
+    lo = t+(rm1<<32);
+    c += lo < t;
+    hi = rh+(rm0>>32)+(rm1>>32)+c;
+    *A = lo;
+    *B = hi;
+#endif
+}
+
+static inline uint64_t wymix(uint64_t A, uint64_t B) {
+    wymum(&A,&B);
+    return A^B;
+}
+
+static inline uint64_t wyr8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v,p,8);
+    return v;
+}
+
+static inline uint64_t wyr4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v,p,4);
+    return v;
+}
+
+static inline uint64_t wyr3(const uint8_t *p, size_t k) {
+    return (((uint64_t)p[0])<<16)|(((uint64_t)p[k>>1])<<8)|p[k-1];
+}
+
+uint64_t wyhash(const void *key, size_t len, uint64_t seed) {
+    const uint8_t *p = key;
+    const uint64_t *s = wyhash_secret;
+    uint64_t a, b;
+
+    seed ^= wymix(seed^s[0],s[1]);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wyr4(p)<<32)|wyr4(p+((len>>3)<<2));
+            b = (wyr4(p+len-4)<<32)|wyr4(p+len-4-((len>>3)<<2));
+        } else if (len > 0) {
+            a = wyr3(p,len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wymix(wyr8(p)^s[1],wyr8(p+8)^seed);
+                see1 = wymix(wyr8(p+16)^s[2],wyr8(p+24)^see1);
+                see2 = wymix(wyr8(p+32)^s[3],wyr8(p+40)^see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1^see2;
+        }
+        while (i > 16) {
+            seed = wymix(wyr8(p)^s[1],wyr8(p+8)^seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wyr8(p+i-16);
+        b = wyr8(p+i-8);
+    }
+    a ^= s[1];
+    b ^= seed;
+    wymum(&a,&b);
+    return wymix(a^s[0]^len,b^s[1]);
+}
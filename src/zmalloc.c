@@ -1,8 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include <string.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include "zmalloc.h"
 #include "atomicvar.h"
@@ -13,20 +16,59 @@
 #define PREFIX_SIZE (sizeof(size_t))
 #endif
 
+/* Explicitly override malloc/free etc when using tcmalloc or jemalloc. */
+#if defined(USE_TCMALLOC)
+#define malloc(size) tc_malloc(size)
+#define calloc(count,size) tc_calloc(count,size)
+#define realloc(ptr,size) tc_realloc(ptr,size)
+#define free(ptr) tc_free(ptr)
+#elif defined(USE_JEMALLOC)
+#define malloc(size) je_malloc(size)
+#define calloc(count,size) je_calloc(count,size)
+#define realloc(ptr,size) je_realloc(ptr,size)
+#define free(ptr) je_free(ptr)
+#endif
+
+/* Every thread accounts its allocations in its own slot, so that threads
+ * allocating at the same time don't write the same cache line. A block freed
+ * by another thread than the one that allocated it makes the two slots drift
+ * apart, but their sum, computed by zmalloc_used_memory(), is still exact
+ * since the counters wrap around. Threads past ZMALLOC_THREAD_SLOTS share
+ * slots, which is why the counters are still updated atomically. */
+#define ZMALLOC_THREAD_SLOTS 64
+#define ZMALLOC_CACHE_LINE 64
+
+typedef struct zmallocSlot {
+    size_t used_memory;
+    char padding[ZMALLOC_CACHE_LINE-sizeof(size_t)];
+} __attribute__((aligned(ZMALLOC_CACHE_LINE))) zmallocSlot;
+
+static zmallocSlot used_memory[ZMALLOC_THREAD_SLOTS];
+static int next_slot = 0;
+static __thread zmallocSlot *thread_slot = NULL;
+
+static zmallocSlot *zmalloc_thread_slot(void) {
+    if (thread_slot == NULL) {
+        int slot;
+
+        atomicGetIncr(next_slot,slot,1);
+        thread_slot = used_memory+(slot % ZMALLOC_THREAD_SLOTS);
+    }
+    return thread_slot;
+}
+
 #define update_zmalloc_stat_alloc(__n) do { \
     size_t _n = __n; \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
-    atomicIncr(used_memory,_n); \
+    atomicIncr(zmalloc_thread_slot()->used_memory,_n); \
 } while(0)
 
 #define update_zmalloc_stat_free(__n) do { \
     size_t _n = __n; \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
-    atomicDecr(used_memory,_n); \
+    atomicDecr(zmalloc_thread_slot()->used_memory,_n); \
 } while(0)
 
-static size_t used_memory = 0;
-
 /* Provide zmalloc_size() for systems where this function is not provided by
  * malloc itself, given that in that case we store a header with this
  * information as the first bytes of every allocation. */
@@ -136,6 +178,8 @@ void zfree(void *ptr) {
 
 void debug_zfree(void *ptr, const char *file, int line, const char *func)
 {
+    if (NULL == ptr) return;
+
     size_t size = zmalloc_size(ptr);
     zfree(ptr);
     printf("Freed = %s, %i, %s, %p[%li]\n", file, line, func, ptr, size);
@@ -149,12 +193,159 @@ char *zstrdup(const char *s) {
     return p;
 }
 
+/* The slots are read one after the other while the other threads go on
+ * allocating, so the result may be off by what they allocated meanwhile. */
 size_t zmalloc_used_memory(void) {
-    size_t um;
-    atomicGet(used_memory, um);
+    size_t um = 0, slot_um;
+    int j, slots;
+
+    /* Only the slots given to a thread so far can be non zero. */
+    atomicGet(next_slot,slots);
+    if (slots > ZMALLOC_THREAD_SLOTS) slots = ZMALLOC_THREAD_SLOTS;
+    for (j = 0; j < slots; j++) {
+        atomicGet(used_memory[j].used_memory,slot_um);
+        um += slot_um;
+    }
     return um;
 }
 
+#ifdef HAVE_DEFRAG
+/* Allocation and free functions that bypass the thread cache and go
+ * straight to the allocator, so that a defragmented object lands in the
+ * fullest page jemalloc has, and the page it leaves is not kept in the
+ * cache. */
+void *zmalloc_no_tcache(size_t size) {
+    void *ptr = je_mallocx(size,MALLOCX_TCACHE_NONE);
+
+    if (!ptr) zmalloc_oom_handler(size);
+    update_zmalloc_stat_alloc(zmalloc_size(ptr));
+    return ptr;
+}
+
+void zfree_no_tcache(void *ptr) {
+    if (ptr == NULL) return;
+    update_zmalloc_stat_free(zmalloc_size(ptr));
+    je_dallocx(ptr,MALLOCX_TCACHE_NONE);
+}
+
+/* Return 1 if moving the allocation elsewhere would help reduce the
+ * fragmentation: it is in a page that is less used than the average page
+ * of its size class, and not in the page new allocations come from. */
+int zmalloc_defrag_hint(void *ptr) {
+    struct {
+        size_t nfree, nregs, size;
+        size_t bin_nfree, bin_nregs;
+        void *slabcur_addr;
+    } out;
+    size_t outsz = sizeof(out);
+
+    if (je_mallctl("experimental.utilization.query",&out,&outsz,
+                   &ptr,sizeof(ptr))) return 0;
+    /* Large allocations and full pages can't do better. */
+    if (out.nregs <= 1 || out.nfree == 0) return 0;
+    if (out.slabcur_addr &&
+        (char*)ptr >= (char*)out.slabcur_addr &&
+        (char*)ptr < (char*)out.slabcur_addr+out.size) return 0;
+    /* Used regions in the page below the average of the size class. */
+    return (out.nregs-out.nfree)*out.bin_nregs <
+           (out.bin_nregs-out.bin_nfree)*out.nregs;
+}
+#endif
+
+/* Get the RSS information in an OS-specific way.
+ *
+ * WARNING: the function zmalloc_get_rss() is not designed to be fast
+ * and may not be called in the busy loops of the server.
+ *
+ * For this kind of "fast RSS reporting" usages use instead the
+ * function zmalloc_used_memory() that tracks the allocated bytes. */
+#if defined(HAVE_PROC_STAT)
+size_t zmalloc_get_rss(void) {
+    int page = sysconf(_SC_PAGESIZE);
+    size_t rss;
+    char buf[4096];
+    char filename[256];
+    int fd, count;
+    char *p, *x;
+
+    snprintf(filename,256,"/proc/%d/stat",getpid());
+    if ((fd = open(filename,O_RDONLY)) == -1) return 0;
+    if (read(fd,buf,4096) <= 0) {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+
+    p = buf;
+    count = 23; /* RSS is the 24th field in /proc/<pid>/stat */
+    while(p && count--) {
+        p = strchr(p,' ');
+        if (p) p++;
+    }
+    if (!p) return 0;
+    x = strchr(p,' ');
+    if (!x) return 0;
+    *x = '\0';
+
+    rss = strtoll(p,NULL,10);
+    rss *= page;
+    return rss;
+}
+#else
+size_t zmalloc_get_rss(void) {
+    /* If we can't get the RSS in an OS-specific way for this system just
+     * return the memory usage we estimated in zmalloc()..
+     *
+     * Fragmentation will appear to be always 1 (no fragmentation)
+     * of course... */
+    return zmalloc_used_memory();
+}
+#endif
+
+#if defined(USE_JEMALLOC)
+/* Get the bytes allocated by the application, the bytes in the pages
+ * holding them and the bytes mapped by the allocator. jemalloc caches its
+ * statistics, so they are refreshed first. */
+int zmalloc_get_allocator_info(size_t *allocated, size_t *active,
+                               size_t *resident)
+{
+    uint64_t epoch = 1;
+    size_t sz;
+
+    *allocated = *resident = *active = 0;
+    sz = sizeof(epoch);
+    je_mallctl("epoch",&epoch,&sz,&epoch,sz);
+    sz = sizeof(size_t);
+    je_mallctl("stats.resident",resident,&sz,NULL,0);
+    je_mallctl("stats.active",active,&sz,NULL,0);
+    je_mallctl("stats.allocated",allocated,&sz,NULL,0);
+    return 1;
+}
+
+/* Give the calling thread an arena of its own. The pages of an arena are
+ * first touched by the thread using it, so the kernel places them on the
+ * NUMA node of that thread, as long as it is pinned to it. Returns 1 if
+ * the thread got a new arena. */
+int zmalloc_thread_local_arena(void) {
+    unsigned arena;
+    size_t sz = sizeof(arena);
+
+    if (je_mallctl("arenas.create",&arena,&sz,NULL,0) != 0) return 0;
+    return je_mallctl("thread.arena",NULL,NULL,&arena,sizeof(arena)) == 0;
+}
+#else
+int zmalloc_get_allocator_info(size_t *allocated, size_t *active,
+                               size_t *resident)
+{
+    *allocated = *resident = *active = 0;
+    return 0;
+}
+
+int zmalloc_thread_local_arena(void) {
+    return 0;
+}
+#endif
+
 /* Returns the size of physical memory (RAM) in bytes.
  * It looks ugly, but this is the cleanest way to achive cross platform results.
  * Cleaned up from:
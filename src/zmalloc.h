@@ -3,7 +3,12 @@
 
 #include "config.h"
 
+/* Double expansion needed for stringification of macro values. */
+#define __xstr(s) __str(s)
+#define __str(s) #s
+
 #if defined(USE_TCMALLOC)
+#define ZMALLOC_LIB ("tcmalloc-" __xstr(TC_VERSION_MAJOR) "." __xstr(TC_VERSION_MINOR))
 #include <google/tcmalloc.h>
 #if (TC_VERSION_MAJOR == 1 && TC_VERSION_MINOR >= 6) || (TC_VERSION_MAJOR > 1)
 #define HAVE_MALLOC_SIZE 1
@@ -11,7 +16,8 @@
 #else
 #error "Newer version of tcmalloc required"
 #endif
-#elif defined(USE_JEMMALOC)
+#elif defined(USE_JEMALLOC)
+#define ZMALLOC_LIB ("jemalloc-" __xstr(JEMALLOC_VERSION_MAJOR) "." __xstr(JEMALLOC_VERSION_MINOR) "." __xstr(JEMALLOC_VERSION_BUGFIX))
 #include <jemalloc/jemalloc.h>
 #if (JEMALLOC_VERSION_MAJOR == 2 && JEMALLOC_VERSION_MINOR >= 1) || (JEMALLOC_VERSION_MAJOR > 2)
 #define HAVE_MALLOC_SIZE 1
@@ -23,6 +29,12 @@
 #include <malloc/malloc.h>
 #define HAVE_MALLOC_SIZE 1
 #define zmalloc_size(p) malloc_size(p)
+#elif defined(__GLIBC__)
+/* The libc allocator knows the size of its blocks as well, so there is no
+ * need for a size prefix in front of every allocation. */
+#include <malloc.h>
+#define HAVE_MALLOC_SIZE 1
+#define zmalloc_size(p) malloc_usable_size(p)
 #endif
 
 #ifndef ZMALLOC_LIB
@@ -30,9 +42,9 @@
 #endif
 
 /* We can enable the defrag capabilities only if we are using Jemalloc
- * and the version used is our special version modified for having
- * the ability to return per-allocation fragmentation hints. */
-#if defined(USE_JEMALLOC) && defined(JEMALLOC_FRAG_HINT)
+ * and the version used is able to tell how full is the page of an
+ * allocation (the "experimental.utilization.query" mallctl, 5.2 and up). */
+#if defined(USE_JEMALLOC) && ((JEMALLOC_VERSION_MAJOR == 5 && JEMALLOC_VERSION_MINOR >= 2) || (JEMALLOC_VERSION_MAJOR > 5))
 #define HAVE_DEFRAG
 #endif
 
@@ -43,6 +55,20 @@ void zfree(void *ptr);
 char *zstrdup(const char *s);
 size_t zmalloc_used_memory(void);
 size_t zmalloc_get_memory_size(void);
+size_t zmalloc_get_rss(void);
+int zmalloc_get_allocator_info(size_t *allocated, size_t *active,
+                               size_t *resident);
+int zmalloc_thread_local_arena(void);
+
+#ifndef HAVE_MALLOC_SIZE
+size_t zmalloc_size(void *ptr);
+#endif
+
+#ifdef HAVE_DEFRAG
+void *zmalloc_no_tcache(size_t size);
+void zfree_no_tcache(void *ptr);
+int zmalloc_defrag_hint(void *ptr);
+#endif
 
 void *debug_zmalloc(size_t size, const char *file, int line, const char *func);
 void debug_zfree(void *ptr, const char *file, int line, const char *func);